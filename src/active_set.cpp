@@ -0,0 +1,82 @@
+#include "active_set.h"
+#include "image.h"
+
+#include <algorithm>
+#include <cassert>
+
+void ActiveSet::clear(int rx, int ry)
+{
+    resx = rx;
+    resy = ry;
+    block.clear();
+    pending.clear();
+}
+
+void ActiveSet::build(const Image& img, uint8_t bitmask)
+{
+    clear(img.resx, img.resy);
+
+    int bw = blockWidth();
+    int bh = blockHeight();
+    for (int by = 0; by < bh; ++by)
+    for (int bx = 0; bx < bw; ++bx) {
+        uint16_t texels = 0;
+        for (int h = 0; h < 4 && (4 * by + h) < resy; ++h)
+        for (int k = 0; k < 4 && (4 * bx + k) < resx; ++k) {
+            if (img.mask(4 * bx + k, 4 * by + h) & bitmask)
+                texels |= (1 << (h * 4 + k));
+        }
+        if (texels)
+            block.push_back({by * bw + bx, texels});
+    }
+}
+
+void ActiveSet::insert(int x, int y)
+{
+    x = wrapCoord(x, resx);
+    y = wrapCoord(y, resy);
+    int bi = (y / 4) * blockWidth() + (x / 4);
+    pending.push_back((bi << 4) | ((y % 4) * 4 + (x % 4)));
+}
+
+void ActiveSet::insertBlock(int bi)
+{
+    assert(bi >= 0 && bi < blockWidth() * blockHeight());
+    for (int t = 0; t < 16; ++t)
+        pending.push_back((bi << 4) | t);
+}
+
+void ActiveSet::finalize()
+{
+    if (pending.empty())
+        return;
+
+    std::sort(pending.begin(), pending.end());
+
+    std::vector<ActiveBlock> merged;
+    merged.reserve(block.size() + pending.size() / 4);
+
+    auto b = block.begin();
+    auto p = pending.begin();
+    while (b != block.end() || p != pending.end()) {
+        int bi = (p == pending.end()) ? b->index
+               : (b == block.end()) ? (*p >> 4)
+               : std::min(b->index, *p >> 4);
+        uint16_t texels = 0;
+        if (b != block.end() && b->index == bi)
+            texels |= (b++)->texels;
+        while (p != pending.end() && (*p >> 4) == bi)
+            texels |= (1 << ((*p++) & 15));
+        merged.push_back({bi, texels});
+    }
+
+    block.swap(merged);
+    pending.clear();
+}
+
+unsigned ActiveSet::ntexels() const
+{
+    unsigned n = 0;
+    forEachTexel([&n](int, int) { n++; });
+    return n;
+}
@@ -0,0 +1,69 @@
+#ifndef ACTIVE_SET_H
+#define ACTIVE_SET_H
+
+#include <cstdint>
+#include <vector>
+
+class Image;
+
+/* A group of active texels inside a 4x4 block. Bit (h * 4 + k) of texels is set
+ * if the texel at row h, column k of the block is active */
+struct ActiveBlock {
+    int index;
+    uint16_t texels;
+};
+
+/* Sparse set of texels, ordered by block. It is built once (either from the
+ * image masks or incrementally by the solvers) so that the later stages only
+ * visit the texels they care about instead of rescanning the whole texture */
+class ActiveSet
+{
+    std::vector<int> pending; // (block index << 4 | texel) keys inserted since the last finalize()
+
+public:
+
+    int resx;
+    int resy;
+
+    std::vector<ActiveBlock> block; // sorted by block index
+
+    ActiveSet() : resx(0), resy(0) {}
+    ActiveSet(const Image& img, uint8_t bitmask) { build(img, bitmask); }
+
+    void clear(int rx, int ry);
+    void build(const Image& img, uint8_t bitmask);
+
+    // insert() and insertBlock() are deferred until the next call to finalize()
+    void insert(int x, int y);
+    void insertBlock(int bi);
+    void finalize();
+
+    int blockWidth() const { return (resx + 3) / 4; }
+    int blockHeight() const { return (resy + 3) / 4; }
+
+    bool empty() const { return block.empty(); }
+    unsigned nblk() const { return block.size(); }
+    unsigned ntexels() const;
+
+    template <typename F>
+    void forEachTexel(const ActiveBlock& b, F f) const {
+        int bw = blockWidth();
+        int x0 = 4 * (b.index % bw);
+        int y0 = 4 * (b.index / bw);
+        for (unsigned bits = b.texels; bits; bits &= bits - 1) {
+            int t = __builtin_ctz(bits);
+            int x = x0 + (t & 3);
+            int y = y0 + (t >> 2);
+            if (x < resx && y < resy)
+                f(x, y);
+        }
+    }
+
+    template <typename F>
+    void forEachTexel(F f) const {
+        for (const ActiveBlock& b : block)
+            forEachTexel(b, f);
+    }
+};
+
+#endif // ACTIVE_SET_H
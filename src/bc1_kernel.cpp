@@ -0,0 +1,457 @@
+#include "bc1_kernel.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+#include <glm/common.hpp>
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(__EMSCRIPTEN__)
+#define BC1_KERNEL_X86
+#include <immintrin.h>
+#endif
+
+static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 must be tightly packed");
+
+static Bc1Kernel::Isa requestedIsa = Bc1Kernel::Auto;
+static float verifyTolerance = -1.0f;
+
+// the normal equations are considered singular if det(AtA) <= SINGULAR_EPS * AtA(0,0) * AtA(1,1)
+static const float SINGULAR_EPS = 1e-4f;
+
+// NOTE the vectorized implementations below perform exactly the same sequence of
+// floating point operations as the scalar one, keep them in sync
+
+static inline float squaredDistance(const vec3& a, const vec3& b)
+{
+    vec3 d = a - b;
+    return d.x * d.x + d.y * d.y + d.z * d.z;
+}
+
+static void encodeScalar(const vec3 *texels, uint16_t fitMask, Block& blk, float *residual)
+{
+    const float a = 2.0f / 3.0f;
+    const float b = 1.0f / 3.0f;
+
+    vec3 c0 = blk.c0;
+    vec3 c1 = blk.c1;
+    vec3 c2 = a * c0 + b * c1;
+    vec3 c3 = b * c0 + a * c1;
+
+    for (int i = 0; i < 16; ++i) {
+        float dmin = squaredDistance(texels[i], c0);
+        float d;
+        unsigned char mask = QMASK_C0;
+
+        if ((d = squaredDistance(texels[i], c2)) < dmin) {
+            dmin = d;
+            mask = QMASK_C0_23_C1_13;
+        }
+
+        if ((d = squaredDistance(texels[i], c3)) < dmin) {
+            dmin = d;
+            mask = QMASK_C0_13_C1_23;
+        }
+
+        if ((d = squaredDistance(texels[i], c1)) < dmin) {
+            dmin = d;
+            mask = QMASK_C1;
+        }
+
+        blk.bit[i] = mask;
+    }
+
+    // normal equations of the least squares endpoint fit
+    float s00 = 0;
+    float s01 = 0;
+    float s11 = 0;
+    vec3 t0(0);
+    vec3 t1(0);
+    int n = 0;
+    for (int i = 0; i < 16; ++i) {
+        if (fitMask & (1 << i)) {
+            float w0 = QMASK_W0[blk.bit[i]];
+            float w1 = QMASK_W1[blk.bit[i]];
+            s00 += w0 * w0;
+            s01 += w0 * w1;
+            s11 += w1 * w1;
+            t0 += w0 * texels[i];
+            t1 += w1 * texels[i];
+            n++;
+        }
+    }
+
+    vec3 x0 = c0;
+    vec3 x1 = c1;
+    float det = s00 * s11 - s01 * s01;
+    if (n > 2 && det > SINGULAR_EPS * (s00 * s11)) {
+        x0 = (s11 * t0 - s01 * t1) / det;
+        x1 = (s00 * t1 - s01 * t0) / det;
+    }
+
+    if (residual) {
+        float r = 0;
+        for (int i = 0; i < 16; ++i) {
+            if (fitMask & (1 << i)) {
+                vec3 e = QMASK_W0[blk.bit[i]] * x0 + QMASK_W1[blk.bit[i]] * x1 - texels[i];
+                r += e.x * e.x + e.y * e.y + e.z * e.z;
+            }
+        }
+        *residual = r;
+    }
+
+    blk.c0 = glm::clamp(x0, vec3(0), vec3(255));
+    blk.c1 = glm::clamp(x1, vec3(0), vec3(255));
+}
+
+#ifdef BC1_KERNEL_X86
+
+__attribute__((target("sse4.1")))
+static inline __m128 squaredDistance4(const __m128 *p, const __m128 *c)
+{
+    __m128 dx = _mm_sub_ps(p[0], c[0]);
+    __m128 dy = _mm_sub_ps(p[1], c[1]);
+    __m128 dz = _mm_sub_ps(p[2], c[2]);
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+}
+
+// encodes 4 blocks
+__attribute__((target("sse4.1")))
+static void encodeSSE41(const vec3 *texels, const uint16_t *fitMask, Block *blk, float *residual)
+{
+    const __m128 a = _mm_set1_ps(2.0f / 3.0f);
+    const __m128 b = _mm_set1_ps(1.0f / 3.0f);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+
+    __m128 c0[3], c1[3], c2[3], c3[3];
+    for (int j = 0; j < 3; ++j) {
+        c0[j] = _mm_set_ps(blk[3].c0[j], blk[2].c0[j], blk[1].c0[j], blk[0].c0[j]);
+        c1[j] = _mm_set_ps(blk[3].c1[j], blk[2].c1[j], blk[1].c1[j], blk[0].c1[j]);
+        c2[j] = _mm_add_ps(_mm_mul_ps(a, c0[j]), _mm_mul_ps(b, c1[j]));
+        c3[j] = _mm_add_ps(_mm_mul_ps(b, c0[j]), _mm_mul_ps(a, c1[j]));
+    }
+
+    const __m128i fm = _mm_set_epi32(fitMask[3], fitMask[2], fitMask[1], fitMask[0]);
+
+    __m128 p[16][3];
+    __m128 w0[16], w1[16]; // weights of the texels in the fit mask, zero otherwise
+    __m128 fit[16];
+    __m128 s00 = zero, s01 = zero, s11 = zero;
+    __m128 t0[3] = { zero, zero, zero };
+    __m128 t1[3] = { zero, zero, zero };
+    __m128i n = _mm_setzero_si128();
+
+    for (int i = 0; i < 16; ++i) {
+        for (int j = 0; j < 3; ++j)
+            p[i][j] = _mm_set_ps(texels[48 + i][j], texels[32 + i][j], texels[16 + i][j], texels[i][j]);
+
+        __m128 dmin = squaredDistance4(p[i], c0);
+        __m128 mask = zero;
+        __m128 wi0 = one;
+        __m128 wi1 = zero;
+        __m128 d, lt;
+
+        d = squaredDistance4(p[i], c2);
+        lt = _mm_cmplt_ps(d, dmin);
+        dmin = _mm_blendv_ps(dmin, d, lt);
+        mask = _mm_blendv_ps(mask, _mm_set1_ps(QMASK_C0_23_C1_13), lt);
+        wi0 = _mm_blendv_ps(wi0, a, lt);
+        wi1 = _mm_blendv_ps(wi1, b, lt);
+
+        d = squaredDistance4(p[i], c3);
+        lt = _mm_cmplt_ps(d, dmin);
+        dmin = _mm_blendv_ps(dmin, d, lt);
+        mask = _mm_blendv_ps(mask, _mm_set1_ps(QMASK_C0_13_C1_23), lt);
+        wi0 = _mm_blendv_ps(wi0, b, lt);
+        wi1 = _mm_blendv_ps(wi1, a, lt);
+
+        d = squaredDistance4(p[i], c1);
+        lt = _mm_cmplt_ps(d, dmin);
+        mask = _mm_blendv_ps(mask, _mm_set1_ps(QMASK_C1), lt);
+        wi0 = _mm_blendv_ps(wi0, zero, lt);
+        wi1 = _mm_blendv_ps(wi1, one, lt);
+
+        alignas(16) int32_t m[4];
+        _mm_store_si128(reinterpret_cast<__m128i *>(m), _mm_cvtps_epi32(mask));
+        for (int k = 0; k < 4; ++k)
+            blk[k].bit[i] = m[k];
+
+        __m128i bit = _mm_set1_epi32(1 << i);
+        __m128i sel = _mm_cmpeq_epi32(_mm_and_si128(fm, bit), bit);
+        fit[i] = _mm_castsi128_ps(sel);
+        n = _mm_sub_epi32(n, sel);
+
+        w0[i] = _mm_and_ps(wi0, fit[i]);
+        w1[i] = _mm_and_ps(wi1, fit[i]);
+        s00 = _mm_add_ps(s00, _mm_mul_ps(w0[i], w0[i]));
+        s01 = _mm_add_ps(s01, _mm_mul_ps(w0[i], w1[i]));
+        s11 = _mm_add_ps(s11, _mm_mul_ps(w1[i], w1[i]));
+        for (int j = 0; j < 3; ++j) {
+            t0[j] = _mm_add_ps(t0[j], _mm_mul_ps(w0[i], p[i][j]));
+            t1[j] = _mm_add_ps(t1[j], _mm_mul_ps(w1[i], p[i][j]));
+        }
+    }
+
+    __m128 det = _mm_sub_ps(_mm_mul_ps(s00, s11), _mm_mul_ps(s01, s01));
+    __m128 solve = _mm_and_ps(
+        _mm_castsi128_ps(_mm_cmpgt_epi32(n, _mm_set1_epi32(2))),
+        _mm_cmpgt_ps(det, _mm_mul_ps(_mm_set1_ps(SINGULAR_EPS), _mm_mul_ps(s00, s11))));
+
+    __m128 x0[3], x1[3];
+    for (int j = 0; j < 3; ++j) {
+        x0[j] = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(s11, t0[j]), _mm_mul_ps(s01, t1[j])), det);
+        x1[j] = _mm_div_ps(_mm_sub_ps(_mm_mul_ps(s00, t1[j]), _mm_mul_ps(s01, t0[j])), det);
+        x0[j] = _mm_blendv_ps(c0[j], x0[j], solve);
+        x1[j] = _mm_blendv_ps(c1[j], x1[j], solve);
+    }
+
+    if (residual) {
+        __m128 r = zero;
+        for (int i = 0; i < 16; ++i) {
+            __m128 e[3];
+            for (int j = 0; j < 3; ++j) {
+                e[j] = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(w0[i], x0[j]), _mm_mul_ps(w1[i], x1[j])), p[i][j]);
+                e[j] = _mm_and_ps(e[j], fit[i]);
+            }
+            r = _mm_add_ps(r, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e[0], e[0]), _mm_mul_ps(e[1], e[1])), _mm_mul_ps(e[2], e[2])));
+        }
+        _mm_storeu_ps(residual, r);
+    }
+
+    alignas(16) float out0[3][4], out1[3][4];
+    for (int j = 0; j < 3; ++j) {
+        _mm_store_ps(out0[j], _mm_min_ps(_mm_max_ps(x0[j], zero), _mm_set1_ps(255.0f)));
+        _mm_store_ps(out1[j], _mm_min_ps(_mm_max_ps(x1[j], zero), _mm_set1_ps(255.0f)));
+    }
+    for (int k = 0; k < 4; ++k) {
+        blk[k].c0 = vec3(out0[0][k], out0[1][k], out0[2][k]);
+        blk[k].c1 = vec3(out1[0][k], out1[1][k], out1[2][k]);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline __m256 squaredDistance8(const __m256 *p, const __m256 *c)
+{
+    __m256 dx = _mm256_sub_ps(p[0], c[0]);
+    __m256 dy = _mm256_sub_ps(p[1], c[1]);
+    __m256 dz = _mm256_sub_ps(p[2], c[2]);
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+}
+
+// encodes 8 blocks
+__attribute__((target("avx2")))
+static void encodeAVX2(const vec3 *texels, const uint16_t *fitMask, Block *blk, float *residual)
+{
+    const __m256 a = _mm256_set1_ps(2.0f / 3.0f);
+    const __m256 b = _mm256_set1_ps(1.0f / 3.0f);
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+
+    __m256 c0[3], c1[3], c2[3], c3[3];
+    for (int j = 0; j < 3; ++j) {
+        c0[j] = _mm256_set_ps(blk[7].c0[j], blk[6].c0[j], blk[5].c0[j], blk[4].c0[j],
+                              blk[3].c0[j], blk[2].c0[j], blk[1].c0[j], blk[0].c0[j]);
+        c1[j] = _mm256_set_ps(blk[7].c1[j], blk[6].c1[j], blk[5].c1[j], blk[4].c1[j],
+                              blk[3].c1[j], blk[2].c1[j], blk[1].c1[j], blk[0].c1[j]);
+        c2[j] = _mm256_add_ps(_mm256_mul_ps(a, c0[j]), _mm256_mul_ps(b, c1[j]));
+        c3[j] = _mm256_add_ps(_mm256_mul_ps(b, c0[j]), _mm256_mul_ps(a, c1[j]));
+    }
+
+    const __m256i fm = _mm256_set_epi32(fitMask[7], fitMask[6], fitMask[5], fitMask[4],
+                                        fitMask[3], fitMask[2], fitMask[1], fitMask[0]);
+
+    // texel i of block k is at float offset (16 * k + i) * 3
+    const __m256i stride = _mm256_set_epi32(7 * 48, 6 * 48, 5 * 48, 4 * 48, 3 * 48, 2 * 48, 1 * 48, 0);
+    const float *base = &texels[0].x;
+
+    __m256 p[16][3];
+    __m256 w0[16], w1[16]; // weights of the texels in the fit mask, zero otherwise
+    __m256 fit[16];
+    __m256 s00 = zero, s01 = zero, s11 = zero;
+    __m256 t0[3] = { zero, zero, zero };
+    __m256 t1[3] = { zero, zero, zero };
+    __m256i n = _mm256_setzero_si256();
+
+    for (int i = 0; i < 16; ++i) {
+        for (int j = 0; j < 3; ++j)
+            p[i][j] = _mm256_i32gather_ps(base + 3 * i + j, stride, 4);
+
+        __m256 dmin = squaredDistance8(p[i], c0);
+        __m256 mask = zero;
+        __m256 wi0 = one;
+        __m256 wi1 = zero;
+        __m256 d, lt;
+
+        d = squaredDistance8(p[i], c2);
+        lt = _mm256_cmp_ps(d, dmin, _CMP_LT_OQ);
+        dmin = _mm256_blendv_ps(dmin, d, lt);
+        mask = _mm256_blendv_ps(mask, _mm256_set1_ps(QMASK_C0_23_C1_13), lt);
+        wi0 = _mm256_blendv_ps(wi0, a, lt);
+        wi1 = _mm256_blendv_ps(wi1, b, lt);
+
+        d = squaredDistance8(p[i], c3);
+        lt = _mm256_cmp_ps(d, dmin, _CMP_LT_OQ);
+        dmin = _mm256_blendv_ps(dmin, d, lt);
+        mask = _mm256_blendv_ps(mask, _mm256_set1_ps(QMASK_C0_13_C1_23), lt);
+        wi0 = _mm256_blendv_ps(wi0, b, lt);
+        wi1 = _mm256_blendv_ps(wi1, a, lt);
+
+        d = squaredDistance8(p[i], c1);
+        lt = _mm256_cmp_ps(d, dmin, _CMP_LT_OQ);
+        mask = _mm256_blendv_ps(mask, _mm256_set1_ps(QMASK_C1), lt);
+        wi0 = _mm256_blendv_ps(wi0, zero, lt);
+        wi1 = _mm256_blendv_ps(wi1, one, lt);
+
+        alignas(32) int32_t m[8];
+        _mm256_store_si256(reinterpret_cast<__m256i *>(m), _mm256_cvtps_epi32(mask));
+        for (int k = 0; k < 8; ++k)
+            blk[k].bit[i] = m[k];
+
+        __m256i bit = _mm256_set1_epi32(1 << i);
+        __m256i sel = _mm256_cmpeq_epi32(_mm256_and_si256(fm, bit), bit);
+        fit[i] = _mm256_castsi256_ps(sel);
+        n = _mm256_sub_epi32(n, sel);
+
+        w0[i] = _mm256_and_ps(wi0, fit[i]);
+        w1[i] = _mm256_and_ps(wi1, fit[i]);
+        s00 = _mm256_add_ps(s00, _mm256_mul_ps(w0[i], w0[i]));
+        s01 = _mm256_add_ps(s01, _mm256_mul_ps(w0[i], w1[i]));
+        s11 = _mm256_add_ps(s11, _mm256_mul_ps(w1[i], w1[i]));
+        for (int j = 0; j < 3; ++j) {
+            t0[j] = _mm256_add_ps(t0[j], _mm256_mul_ps(w0[i], p[i][j]));
+            t1[j] = _mm256_add_ps(t1[j], _mm256_mul_ps(w1[i], p[i][j]));
+        }
+    }
+
+    __m256 det = _mm256_sub_ps(_mm256_mul_ps(s00, s11), _mm256_mul_ps(s01, s01));
+    __m256 solve = _mm256_and_ps(
+        _mm256_castsi256_ps(_mm256_cmpgt_epi32(n, _mm256_set1_epi32(2))),
+        _mm256_cmp_ps(det, _mm256_mul_ps(_mm256_set1_ps(SINGULAR_EPS), _mm256_mul_ps(s00, s11)), _CMP_GT_OQ));
+
+    __m256 x0[3], x1[3];
+    for (int j = 0; j < 3; ++j) {
+        x0[j] = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(s11, t0[j]), _mm256_mul_ps(s01, t1[j])), det);
+        x1[j] = _mm256_div_ps(_mm256_sub_ps(_mm256_mul_ps(s00, t1[j]), _mm256_mul_ps(s01, t0[j])), det);
+        x0[j] = _mm256_blendv_ps(c0[j], x0[j], solve);
+        x1[j] = _mm256_blendv_ps(c1[j], x1[j], solve);
+    }
+
+    if (residual) {
+        __m256 r = zero;
+        for (int i = 0; i < 16; ++i) {
+            __m256 e[3];
+            for (int j = 0; j < 3; ++j) {
+                e[j] = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(w0[i], x0[j]), _mm256_mul_ps(w1[i], x1[j])), p[i][j]);
+                e[j] = _mm256_and_ps(e[j], fit[i]);
+            }
+            r = _mm256_add_ps(r, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e[0], e[0]), _mm256_mul_ps(e[1], e[1])), _mm256_mul_ps(e[2], e[2])));
+        }
+        _mm256_storeu_ps(residual, r);
+    }
+
+    alignas(32) float out0[3][8], out1[3][8];
+    for (int j = 0; j < 3; ++j) {
+        _mm256_store_ps(out0[j], _mm256_min_ps(_mm256_max_ps(x0[j], zero), _mm256_set1_ps(255.0f)));
+        _mm256_store_ps(out1[j], _mm256_min_ps(_mm256_max_ps(x1[j], zero), _mm256_set1_ps(255.0f)));
+    }
+    for (int k = 0; k < 8; ++k) {
+        blk[k].c0 = vec3(out0[0][k], out0[1][k], out0[2][k]);
+        blk[k].c1 = vec3(out1[0][k], out1[1][k], out1[2][k]);
+    }
+}
+
+#endif // BC1_KERNEL_X86
+
+static Bc1Kernel::Isa detectIsa()
+{
+#ifdef BC1_KERNEL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return Bc1Kernel::AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return Bc1Kernel::SSE41;
+#endif
+    return Bc1Kernel::Scalar;
+}
+
+static float maxDifference(const Block& b1, const Block& b2)
+{
+    float d = 0;
+    for (int i = 0; i < 16; ++i) {
+        vec3 c1 = QMASK_W0[b1.bit[i]] * b1.c0 + QMASK_W1[b1.bit[i]] * b1.c1;
+        vec3 c2 = QMASK_W0[b2.bit[i]] * b2.c0 + QMASK_W1[b2.bit[i]] * b2.c1;
+        vec3 e = glm::abs(c1 - c2);
+        d = std::max(d, std::max(e.x, std::max(e.y, e.z)));
+    }
+    vec3 e = glm::max(glm::abs(b1.c0 - b2.c0), glm::abs(b1.c1 - b2.c1));
+    return std::max(d, std::max(e.x, std::max(e.y, e.z)));
+}
+
+void Bc1Kernel::setIsa(Isa isa)
+{
+    requestedIsa = isa;
+}
+
+Bc1Kernel::Isa Bc1Kernel::isa()
+{
+    static const Isa supported = detectIsa();
+    if (requestedIsa == Auto || requestedIsa > supported)
+        return supported;
+    else
+        return requestedIsa;
+}
+
+void Bc1Kernel::setTolerance(float tol)
+{
+    verifyTolerance = tol;
+}
+
+float Bc1Kernel::tolerance()
+{
+    return verifyTolerance;
+}
+
+void Bc1Kernel::runScalar(const vec3 *texels, const uint16_t *fitMask, Block *blk, float *residual, int n)
+{
+    for (int k = 0; k < n; ++k)
+        encodeScalar(texels + 16 * k, fitMask[k], blk[k], residual ? residual + k : nullptr);
+}
+
+void Bc1Kernel::run(const vec3 *texels, const uint16_t *fitMask, Block *blk, float *residual, int n)
+{
+    int k = 0;
+
+#ifdef BC1_KERNEL_X86
+    Isa impl = isa();
+    int lanes = (impl == AVX2) ? 8 : (impl == SSE41) ? 4 : 0;
+
+    for (; lanes > 0 && k + lanes <= n; k += lanes) {
+        Block ref[8];
+        float rref[8];
+        if (verifyTolerance >= 0)
+            std::copy(blk + k, blk + k + lanes, ref);
+
+        if (impl == AVX2)
+            encodeAVX2(texels + 16 * k, fitMask + k, blk + k, residual ? residual + k : nullptr);
+        else
+            encodeSSE41(texels + 16 * k, fitMask + k, blk + k, residual ? residual + k : nullptr);
+
+        if (verifyTolerance >= 0) {
+            runScalar(texels + 16 * k, fitMask + k, ref, rref, lanes);
+            for (int i = 0; i < lanes; ++i) {
+                float d = maxDifference(blk[k + i], ref[i]);
+                if (d > verifyTolerance) {
+                    std::cerr << "Bc1Kernel: vectorized result differs from scalar path by " << d << ", using scalar result" << std::endl;
+                    blk[k + i] = ref[i];
+                    if (residual)
+                        residual[k + i] = rref[i];
+                }
+            }
+        }
+    }
+#endif
+
+    runScalar(texels + 16 * k, fitMask + k, blk + k, residual ? residual + k : nullptr, n - k);
+}
@@ -0,0 +1,43 @@
+#ifndef BC1_KERNEL_H
+#define BC1_KERNEL_H
+
+#include "compressed_image.h"
+
+#include <cstdint>
+
+/* Batched BC1 block kernel.
+ *
+ * Given the 16 texels (stored by row) of n blocks and the starting endpoints in
+ * blk[i].c0 and blk[i].c1, the kernel builds the 4 color palette of each block,
+ * assigns every texel to its nearest palette entry (squared distance) and, if
+ * more than two texels are set in fitMask[i], refits the endpoints to those
+ * texels solving the 2x2 least squares normal equations. The squared residual of
+ * the fit (before clamping) is stored in residual[i] when residual is not null.
+ *
+ * The SSE4.1 and AVX2 implementations process 4 and 8 blocks at a time; the
+ * implementation is chosen at runtime from the cpu features and can be
+ * overridden with setIsa(). If the tolerance is non-negative the vectorized
+ * results are checked against the scalar path, and blocks that differ by more
+ * than the tolerance are reported and replaced by the scalar result */
+class Bc1Kernel {
+
+public:
+
+    enum Isa {
+        Auto,
+        Scalar,
+        SSE41,
+        AVX2
+    };
+
+    static void setIsa(Isa isa);
+    static Isa isa(); // the implementation actually in use
+
+    static void setTolerance(float tol);
+    static float tolerance();
+
+    static void run(const vec3 *texels, const uint16_t *fitMask, Block *blk, float *residual, int n);
+    static void runScalar(const vec3 *texels, const uint16_t *fitMask, Block *blk, float *residual, int n);
+};
+
+#endif // BC1_KERNEL_H
@@ -0,0 +1,116 @@
+/* Compares the texel layouts of Image on block encoding, bulk block and row
+ * reads, and bilinear sampling along seam-like segments.
+ *
+ * Usage: bench_image [resolution] [repetitions] */
+
+#include "image.h"
+#include "compressed_image.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+static void makeImage(Image& img, int res)
+{
+    img.resize(res, res);
+    unsigned seed = 1;
+    for (int y = 0; y < res; ++y)
+    for (int x = 0; x < res; ++x) {
+        seed = seed * 1664525u + 1013904223u;
+        float noise = float(seed >> 24) / 16.0f;
+        img.pixel(x, y) = vec3(
+            127.5f + 120.0f * std::sin(x * 0.05f),
+            127.5f + 120.0f * std::cos(y * 0.03f),
+            float((x + y) % 240) + noise);
+        img.mask(x, y) = Image::MaskBit::Internal;
+    }
+}
+
+// short segments in random directions, as the seams of a uv atlas
+static std::vector<vec2> makeSegments(int res, int n)
+{
+    std::vector<vec2> seg(2 * n);
+    unsigned seed = 5;
+    for (int i = 0; i < n; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        float x = float(seed >> 8) / float(1 << 24) * res;
+        seed = seed * 1664525u + 1013904223u;
+        float y = float(seed >> 8) / float(1 << 24) * res;
+        seed = seed * 1664525u + 1013904223u;
+        float a = float(seed >> 8) / float(1 << 24) * 6.2831853f;
+        seg[2 * i] = vec2(x, y);
+        seg[2 * i + 1] = vec2(x, y) + 32.0f * vec2(std::cos(a), std::sin(a));
+    }
+    return seg;
+}
+
+static double timeMs(int reps, const std::function<void()>& f)
+{
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < reps; ++i)
+        f();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(t1 - t0).count() / reps;
+}
+
+int main(int argc, char *argv[])
+{
+    int res = (argc > 1) ? std::atoi(argv[1]) : 2048;
+    int reps = (argc > 2) ? std::atoi(argv[2]) : 5;
+
+    std::vector<vec2> seg = makeSegments(res, res * 4);
+
+    std::printf("%dx%d texture, %zu segments, %d repetitions\n", res, res, seg.size() / 2, reps);
+    std::printf("%-10s %12s %12s %12s %12s\n", "layout", "encode ms", "block ms", "row ms", "seam ms");
+
+    const char *name[] = { "RowMajor", "Tiled" };
+    Image::Layout layout[] = { Image::RowMajor, Image::Tiled };
+
+    for (int l = 0; l < 2; ++l) {
+        Image img(Image::Float, layout[l]);
+        makeImage(img, res);
+
+        CompressedImage cimg;
+        double tenc = timeMs(reps, [&]() { cimg.initialize(img, Image::MaskBit::Internal); });
+
+        double blockSum = 0;
+        double tblock = timeMs(reps, [&]() {
+            vec3 texels[16];
+            blockSum = 0;
+            for (int by = 0; by < res / 4; ++by)
+            for (int bx = 0; bx < res / 4; ++bx) {
+                img.readBlock(bx, by, texels);
+                for (int t = 0; t < 16; ++t)
+                    blockSum += texels[t].x;
+            }
+        });
+
+        double rowSum = 0;
+        double trow = timeMs(reps, [&]() {
+            std::vector<vec3> row(res);
+            rowSum = 0;
+            for (int y = 0; y < res; ++y) {
+                img.readRow(y, row.data());
+                for (int x = 0; x < res; ++x)
+                    rowSum += row[x].x;
+            }
+        });
+
+        double seamSum = 0;
+        double tseam = timeMs(reps, [&]() {
+            seamSum = 0;
+            for (unsigned i = 0; i < seg.size(); i += 2) {
+                for (float t = 0; t <= 1; t += 1.0f / 64.0f)
+                    seamSum += img.pixel(mix(seg[i], seg[i + 1], t)).x;
+            }
+        });
+
+        std::printf("%-10s %12.3f %12.3f %12.3f %12.3f   (sums %.0f %.0f %.0f)\n", name[l],
+                    tenc, tblock, trow, tseam, blockSum, rowSum, seamSum);
+    }
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/* Compares the block layouts of CompressedImage on the passes that touch all
+ * the blocks of a texture.
+ *
+ * Usage: bench_layout [resolution] [repetitions] */
+
+#include "image.h"
+#include "compressed_image.h"
+#include "active_set.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <vector>
+
+static void makeImage(Image& img, int res)
+{
+    img.resize(res, res);
+    unsigned seed = 1;
+    for (int y = 0; y < res; ++y)
+    for (int x = 0; x < res; ++x) {
+        seed = seed * 1664525u + 1013904223u;
+        float noise = float(seed >> 24) / 16.0f;
+        img.pixel(x, y) = vec3(
+            127.5f + 120.0f * std::sin(x * 0.05f),
+            127.5f + 120.0f * std::cos(y * 0.03f),
+            float((x + y) % 240) + noise);
+        img.mask(x, y) = Image::MaskBit::Internal;
+    }
+}
+
+static double timeMs(int reps, const std::function<void()>& f)
+{
+    auto t0 = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < reps; ++i)
+        f();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double, std::milli>(t1 - t0).count() / reps;
+}
+
+static size_t blockMemory(const CompressedImage& cimg)
+{
+    return cimg.data.size() * sizeof(Block)
+         + cimg.packed.size() * sizeof(PackedBlock)
+         + 6 * cimg.arrays.c0[0].size() * sizeof(float)
+         + cimg.arrays.selector.size() * sizeof(uint32_t);
+}
+
+int main(int argc, char *argv[])
+{
+    int res = (argc > 1) ? std::atoi(argv[1]) : 2048;
+    int reps = (argc > 2) ? std::atoi(argv[2]) : 5;
+
+    Image img;
+    makeImage(img, res);
+    ActiveSet active(img, Image::MaskBit::Internal);
+
+    std::printf("%dx%d texture, %u blocks, %d repetitions\n", res, res, active.nblk(), reps);
+    std::printf("%-8s %10s %12s %12s %12s %12s\n", "layout", "MB", "init ms", "quant ms", "error ms", "set ms");
+
+    // all the endpoints, as written back by the solver. They are taken from a
+    // Float encoding (the Packed layout quantizes its endpoints when encoding)
+    // so that every layout is given the same input
+    std::vector<int> index;
+    std::vector<vec3> color;
+    {
+        CompressedImage reference(CompressedImage::Float);
+        reference.initialize(img, Image::MaskBit::Internal);
+        for (unsigned i = 0; i < 2 * reference.nblk(); ++i) {
+            index.push_back(i);
+            color.push_back(reference.getEndpoint(i / 2, i % 2) + vec3(0.3f));
+        }
+    }
+
+    const char *name[] = { "Float", "Packed", "SoA" };
+    CompressedImage::Layout layout[] = { CompressedImage::Float, CompressedImage::Packed, CompressedImage::SoA };
+
+    for (int l = 0; l < 3; ++l) {
+        CompressedImage cimg(layout[l]);
+
+        double tinit = timeMs(reps, [&]() { cimg.initialize(img, Image::MaskBit::Internal); });
+
+        double tset = timeMs(reps, [&]() { cimg.setBlockColors(index.size(), index.data(), color.data()); });
+        double tquant = timeMs(reps, [&]() {
+            cimg.setBlockColors(index.size(), index.data(), color.data());
+            cimg.quantizeBlocks();
+        }) - tset;
+
+        double err = 0;
+        double terr = timeMs(reps, [&]() {
+            std::vector<BlockErrorData> e = cimg.computePerBlockError(img, active);
+            err = 0;
+            for (const BlockErrorData& b : e)
+                err += b.avgError;
+        });
+
+        std::printf("%-8s %10.2f %12.3f %12.3f %12.3f %12.3f   (error sum %.4f)\n", name[l],
+                    blockMemory(cimg) / (1024.0 * 1024.0), tinit, tquant, terr, tset, err);
+    }
+
+    return 0;
+}
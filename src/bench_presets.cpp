@@ -0,0 +1,155 @@
+/* Reports the throughput (blocks/s) and the RMSE of each encoder preset on a
+ * fixed corpus of synthetic textures.
+ *
+ * Usage: bench_presets [resolution] [repetitions] */
+
+#include "image.h"
+#include "compressed_image.h"
+#include "metric.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+struct CorpusImage {
+    std::string name;
+    Image img;
+};
+
+static unsigned nextRandom(unsigned& seed)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return seed >> 8;
+}
+
+static vec3 gradient(int x, int y, int res)
+{
+    float u = float(x) / res;
+    float v = float(y) / res;
+    return vec3(255.0f * u, 255.0f * v, 255.0f * (1.0f - 0.5f * (u + v)));
+}
+
+// smooth color ramps
+static void makeGradient(Image& img, int res)
+{
+    for (int y = 0; y < res; ++y)
+    for (int x = 0; x < res; ++x)
+        img.pixel(x, y) = gradient(x, y, res);
+}
+
+// photographic-like content: low frequency color plus per texel noise
+static void makeNoise(Image& img, int res)
+{
+    unsigned seed = 7;
+    for (int y = 0; y < res; ++y)
+    for (int x = 0; x < res; ++x) {
+        vec3 base(127.5f + 100.0f * std::sin(x * 0.031f + y * 0.017f),
+                  127.5f + 100.0f * std::sin(x * 0.013f - y * 0.029f),
+                  127.5f + 100.0f * std::cos(x * 0.023f));
+        vec3 noise(nextRandom(seed) % 48, nextRandom(seed) % 48, nextRandom(seed) % 48);
+        img.pixel(x, y) = glm::clamp(base + noise - vec3(24), vec3(0), vec3(255));
+    }
+}
+
+// hard edges between saturated colors
+static void makeEdges(Image& img, int res)
+{
+    const vec3 palette[4] = { vec3(230, 40, 30), vec3(20, 200, 60), vec3(40, 60, 220), vec3(250, 240, 200) };
+    for (int y = 0; y < res; ++y)
+    for (int x = 0; x < res; ++x) {
+        int dx = x - res / 2;
+        int dy = y - res / 2;
+        int ring = int(std::sqrt(float(dx * dx + dy * dy)) / 7.0f);
+        int stripe = ((x + 2 * y) / 11) % 2;
+        img.pixel(x, y) = palette[(ring + stripe) % 4];
+    }
+}
+
+// texture atlas: flat and shaded charts over black padding
+static void makeAtlas(Image& img, int res)
+{
+    for (int y = 0; y < res; ++y)
+    for (int x = 0; x < res; ++x)
+        img.pixel(x, y) = vec3(0);
+
+    unsigned seed = 3;
+    int ncharts = 24;
+    for (int c = 0; c < ncharts; ++c) {
+        int w = res / 8 + nextRandom(seed) % (res / 6);
+        int h = res / 8 + nextRandom(seed) % (res / 6);
+        int x0 = nextRandom(seed) % (res - w);
+        int y0 = nextRandom(seed) % (res - h);
+        vec3 color(nextRandom(seed) % 256, nextRandom(seed) % 256, nextRandom(seed) % 256);
+        bool shaded = (c % 2) == 1;
+        for (int y = y0; y < y0 + h; ++y)
+        for (int x = x0; x < x0 + w; ++x) {
+            float s = shaded ? 0.5f + 0.5f * float(x - x0) / w : 1.0f;
+            img.pixel(x, y) = color * s;
+        }
+    }
+}
+
+static std::vector<CorpusImage> makeCorpus(int res)
+{
+    std::vector<CorpusImage> corpus(4);
+    corpus[0].name = "gradient";
+    corpus[1].name = "noise";
+    corpus[2].name = "edges";
+    corpus[3].name = "atlas";
+    for (CorpusImage& ci : corpus)
+        ci.img.resize(res, res);
+    makeGradient(corpus[0].img, res);
+    makeNoise(corpus[1].img, res);
+    makeEdges(corpus[2].img, res);
+    makeAtlas(corpus[3].img, res);
+    return corpus;
+}
+
+int main(int argc, char *argv[])
+{
+    int res = (argc > 1) ? std::atoi(argv[1]) : 512;
+    int reps = (argc > 2) ? std::atoi(argv[2]) : 3;
+
+    std::vector<CorpusImage> corpus = makeCorpus(res);
+
+    std::printf("%zu images %dx%d, %d repetitions\n", corpus.size(), res, res, reps);
+    std::printf("%-12s %-10s %14s %10s\n", "preset", "image", "blocks/s", "RMSE");
+
+    for (int p = CompressedImage::Fast; p <= CompressedImage::Exhaustive; ++p) {
+        CompressedImage::Preset preset = CompressedImage::Preset(p);
+        double totalSeconds = 0;
+        double totalBlocks = 0;
+        double totalMse = 0;
+
+        for (const CorpusImage& ci : corpus) {
+            CompressedImage cimg;
+            cimg.setPreset(preset);
+
+            auto t0 = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < reps; ++i) {
+                cimg.initialize(ci.img, 0);
+                cimg.quantizeBlocks();
+            }
+            auto t1 = std::chrono::high_resolution_clock::now();
+
+            double seconds = std::chrono::duration<double>(t1 - t0).count();
+            double blocks = double(cimg.nblk()) * reps;
+            double err = mse(ci.img, cimg);
+
+            std::printf("%-12s %-10s %14.0f %10.4f\n", CompressedImage::presetName(preset), ci.name.c_str(),
+                        blocks / seconds, std::sqrt(err));
+
+            totalSeconds += seconds;
+            totalBlocks += blocks;
+            totalMse += err;
+        }
+
+        std::printf("%-12s %-10s %14.0f %10.4f\n\n", CompressedImage::presetName(preset), "(all)",
+                    totalBlocks / totalSeconds, std::sqrt(totalMse / corpus.size()));
+    }
+
+    return 0;
+}
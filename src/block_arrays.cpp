@@ -0,0 +1,250 @@
+#include "block_arrays.h"
+#include "active_set.h"
+#include "compressed_image.h"
+#include "image.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+#if defined(__SSE2__) && !defined(__EMSCRIPTEN__)
+#define BLOCK_ARRAYS_SSE2
+#include <emmintrin.h>
+#endif
+
+// NOTE the vectorized loops below perform the same floating point operations as
+// the scalar code in compressed_image.cpp (quantizeColor/quantized2rgb and
+// decodeBlock/glm::distance), so that all the layouts give identical results
+
+static const int PADDING = 8;
+
+void BlockArrays::resize(int nblk)
+{
+    n = nblk;
+    int padded = ((nblk + PADDING - 1) / PADDING) * PADDING;
+    for (int k = 0; k < 3; ++k) {
+        c0[k].assign(padded, 0.0f);
+        c1[k].assign(padded, 0.0f);
+    }
+    selector.assign(padded, 0);
+}
+
+void BlockArrays::clear()
+{
+    resize(0);
+}
+
+Block BlockArrays::get(int i) const
+{
+    Block blk;
+    blk.c0 = endpoint(i, 0);
+    blk.c1 = endpoint(i, 1);
+    for (int t = 0; t < 16; ++t)
+        blk.bit[t] = mask(i, t);
+    return blk;
+}
+
+void BlockArrays::set(int i, const Block& blk)
+{
+    setEndpoint(i, 0, blk.c0);
+    setEndpoint(i, 1, blk.c1);
+    uint32_t sel = 0;
+    for (int t = 0; t < 16; ++t)
+        sel |= (uint32_t(blk.bit[t]) << (2 * t));
+    selector[i] = sel;
+}
+
+// -- endpoint updates ---------------------------------------------------------
+
+static_assert(sizeof(vec3) == 3 * sizeof(float), "vec3 must be 3 packed floats");
+
+void BlockArrays::setEndpoints(int count, const int *index, const vec3 *c)
+{
+    int i = 0;
+    while (i < count) {
+#ifdef BLOCK_ARRAYS_SSE2
+        // both endpoints of 4 consecutive blocks: the 24 floats of c hold 4
+        // rows (c0.r c0.g c0.b c1.r c1.g c1.b), transposed in two 4x4 steps
+        if (index[i] % 2 == 0 && i + 8 <= count && index[i + 7] == index[i] + 7) {
+            bool run = true;
+            for (int j = 1; j < 7 && run; ++j)
+                run = (index[i + j] == index[i] + j);
+            if (run) {
+                const float *f = &c[i].x;
+                int bi = index[i] / 2;
+                __m128 r0 = _mm_loadu_ps(f);
+                __m128 r1 = _mm_loadu_ps(f + 6);
+                __m128 r2 = _mm_loadu_ps(f + 12);
+                __m128 r3 = _mm_loadu_ps(f + 18);
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                _mm_storeu_ps(c0[0].data() + bi, r0);
+                _mm_storeu_ps(c0[1].data() + bi, r1);
+                _mm_storeu_ps(c0[2].data() + bi, r2);
+                _mm_storeu_ps(c1[0].data() + bi, r3);
+                r0 = _mm_loadu_ps(f + 2);
+                r1 = _mm_loadu_ps(f + 8);
+                r2 = _mm_loadu_ps(f + 14);
+                r3 = _mm_loadu_ps(f + 20);
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+                _mm_storeu_ps(c1[1].data() + bi, r2);
+                _mm_storeu_ps(c1[2].data() + bi, r3);
+                i += 8;
+                continue;
+            }
+        }
+#endif
+        setEndpoint(index[i] / 2, index[i] % 2, c[i]);
+        i++;
+    }
+}
+
+// -- quantization -------------------------------------------------------------
+
+// round to the nearest integer, shift out the low bits and expand back to [0, 255]
+static void quantizeChannel(float *v, int count, int shift)
+{
+    const float scale = 255.0f / float(255 >> shift);
+    int i = 0;
+
+#ifdef BLOCK_ARRAYS_SSE2
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 vscale = _mm_set1_ps(scale);
+    const __m128i vshift = _mm_cvtsi32_si128(shift);
+    for (; i + 4 <= count; i += 4) {
+        // std::round() of non negative values: truncate and add one if the
+        // (exact) fractional part is at least 0.5
+        __m128 x = _mm_loadu_ps(v + i);
+        __m128i t = _mm_cvttps_epi32(x);
+        __m128 frac = _mm_sub_ps(x, _mm_cvtepi32_ps(t));
+        t = _mm_sub_epi32(t, _mm_castps_si128(_mm_cmpge_ps(frac, half)));
+        t = _mm_srl_epi32(t, vshift);
+        _mm_storeu_ps(v + i, _mm_mul_ps(_mm_cvtepi32_ps(t), vscale));
+    }
+#endif
+
+    for (; i < count; ++i) {
+        uint16_t q = uint16_t(std::round(v[i])) >> shift;
+        v[i] = q * scale;
+    }
+}
+
+void BlockArrays::quantize(int first, int count)
+{
+    assert(first >= 0 && first + count <= n);
+    static const int shift[3] = { 3, 2, 3 };
+    for (int k = 0; k < 3; ++k) {
+        quantizeChannel(c0[k].data() + first, count, shift[k]);
+        quantizeChannel(c1[k].data() + first, count, shift[k]);
+    }
+}
+
+// -- error evaluation ---------------------------------------------------------
+
+static BlockErrorData blockErrorScalar(const BlockArrays& arr, const Image& img, const ActiveBlock& b)
+{
+    int bw = img.resx / 4;
+    int x0 = 4 * (b.index % bw);
+    int y0 = 4 * (b.index / bw);
+    vec3 c0 = arr.endpoint(b.index, 0);
+    vec3 c1 = arr.endpoint(b.index, 1);
+
+    float minError = 1e10;
+    float maxError = 0;
+    float totalError = 0;
+    int n = 0;
+    for (unsigned bits = b.texels; bits; bits &= bits - 1) {
+        int t = __builtin_ctz(bits);
+        float a = QMASK_W1[arr.mask(b.index, t)];
+        vec3 d = img.pixel(x0 + (t & 3), y0 + (t >> 2)) - (c0 * (1.0f - a) + c1 * a);
+        float dist = std::sqrt(d.x * d.x + d.y * d.y + d.z * d.z);
+        minError = std::min(minError, dist);
+        maxError = std::max(maxError, dist);
+        totalError += dist;
+        n++;
+    }
+    return { b.index, minError, maxError, totalError / n };
+}
+
+#ifdef BLOCK_ARRAYS_SSE2
+
+static inline __m128 select(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// evaluates 4 blocks at a time, one per lane
+static void blockError4(const BlockArrays& arr, const Image& img, const ActiveBlock *b, BlockErrorData *out)
+{
+    int bw = img.resx / 4;
+    alignas(16) float e[6][4];
+    alignas(16) int x0[4], y0[4];
+    for (int l = 0; l < 4; ++l) {
+        for (int k = 0; k < 3; ++k) {
+            e[k][l] = arr.c0[k][b[l].index];
+            e[3 + k][l] = arr.c1[k][b[l].index];
+        }
+        x0[l] = 4 * (b[l].index % bw);
+        y0[l] = 4 * (b[l].index / bw);
+    }
+    __m128 c0[3], c1[3];
+    for (int k = 0; k < 3; ++k) {
+        c0[k] = _mm_load_ps(e[k]);
+        c1[k] = _mm_load_ps(e[3 + k]);
+    }
+
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 vmin = _mm_set1_ps(1e10f);
+    __m128 vmax = _mm_setzero_ps();
+    __m128 vtot = _mm_setzero_ps();
+
+    for (int t = 0; t < 16; ++t) {
+        alignas(16) float src[3][4];
+        alignas(16) float w[4];
+        alignas(16) int active[4];
+        for (int l = 0; l < 4; ++l) {
+            active[l] = (b[l].texels & (1 << t)) ? -1 : 0;
+            vec3 p = img.pixel(x0[l] + (t & 3), y0[l] + (t >> 2));
+            src[0][l] = p.x;
+            src[1][l] = p.y;
+            src[2][l] = p.z;
+            w[l] = QMASK_W1[arr.mask(b[l].index, t)];
+        }
+        __m128 on = _mm_castsi128_ps(_mm_load_si128(reinterpret_cast<const __m128i *>(active)));
+        if (_mm_movemask_ps(on) == 0)
+            continue;
+
+        __m128 a = _mm_load_ps(w);
+        __m128 a0 = _mm_sub_ps(one, a);
+        __m128 d2 = _mm_setzero_ps();
+        for (int k = 0; k < 3; ++k) {
+            __m128 c = _mm_add_ps(_mm_mul_ps(c0[k], a0), _mm_mul_ps(c1[k], a));
+            __m128 d = _mm_sub_ps(_mm_load_ps(src[k]), c);
+            d2 = (k == 0) ? _mm_mul_ps(d, d) : _mm_add_ps(d2, _mm_mul_ps(d, d));
+        }
+        __m128 dist = _mm_sqrt_ps(d2);
+        vmin = select(on, _mm_min_ps(dist, vmin), vmin);
+        vmax = select(on, _mm_max_ps(dist, vmax), vmax);
+        vtot = select(on, _mm_add_ps(vtot, dist), vtot);
+    }
+
+    alignas(16) float rmin[4], rmax[4], rtot[4];
+    _mm_store_ps(rmin, vmin);
+    _mm_store_ps(rmax, vmax);
+    _mm_store_ps(rtot, vtot);
+    for (int l = 0; l < 4; ++l)
+        out[l] = { b[l].index, rmin[l], rmax[l], rtot[l] / __builtin_popcount(b[l].texels) };
+}
+
+#endif
+
+void BlockArrays::blockError(const Image& img, const ActiveBlock *b, int count, BlockErrorData *out) const
+{
+    int i = 0;
+    assert(img.resx % 4 == 0 && img.resy % 4 == 0);
+#ifdef BLOCK_ARRAYS_SSE2
+    for (; i + 4 <= count; i += 4)
+        blockError4(*this, img, b + i, out + i);
+#endif
+    for (; i < count; ++i)
+        out[i] = blockErrorScalar(*this, img, b[i]);
+}
@@ -0,0 +1,102 @@
+#ifndef BLOCK_ARRAYS_H
+#define BLOCK_ARRAYS_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include <glm/vec3.hpp>
+
+using namespace glm;
+
+class Image;
+struct ActiveBlock;
+struct Block;
+struct BlockErrorData;
+
+template <typename T, std::size_t Alignment>
+struct AlignedAllocator {
+    typedef T value_type;
+
+    template <typename U>
+    struct rebind {
+        typedef AlignedAllocator<U, Alignment> other;
+    };
+
+    AlignedAllocator() {}
+
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {}
+
+    T *allocate(std::size_t n) {
+        void *p = nullptr;
+        if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+            throw std::bad_alloc();
+        return static_cast<T *>(p);
+    }
+
+    void deallocate(T *p, std::size_t) {
+        std::free(p);
+    }
+};
+
+template <typename T, typename U, std::size_t A>
+bool operator==(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return true; }
+
+template <typename T, typename U, std::size_t A>
+bool operator!=(const AlignedAllocator<T, A>&, const AlignedAllocator<U, A>&) { return false; }
+
+typedef std::vector<float, AlignedAllocator<float, 32>> AlignedFloatVector;
+
+/* Structure of arrays storage for BC1 blocks: one array per endpoint channel
+ * and the 2 bit indices of each block packed in a 32 bit word (same encoding
+ * as PackedBlock::index). The arrays are 32 byte aligned and padded to a
+ * multiple of 8 blocks, so that the passes that touch the same field of many
+ * blocks can process several blocks at a time */
+struct BlockArrays {
+    AlignedFloatVector c0[3];
+    AlignedFloatVector c1[3];
+    std::vector<uint32_t> selector;
+
+    int n;
+
+    BlockArrays() : n(0) {}
+
+    void resize(int nblk);
+    void clear();
+    int size() const { return n; }
+
+    Block get(int i) const;
+    void set(int i, const Block& blk);
+
+    vec3 endpoint(int i, int ci) const {
+        const AlignedFloatVector *c = (ci == 0) ? c0 : c1;
+        return vec3(c[0][i], c[1][i], c[2][i]);
+    }
+
+    void setEndpoint(int i, int ci, const vec3& v) {
+        AlignedFloatVector *c = (ci == 0) ? c0 : c1;
+        c[0][i] = v.x;
+        c[1][i] = v.y;
+        c[2][i] = v.z;
+    }
+
+    /* sets count endpoints, endpoint ci of block bi has index 2 * bi + ci (as
+     * in CompressedImage::setBlockColors()). Runs of indices that cover both
+     * endpoints of consecutive blocks are written a channel at a time */
+    void setEndpoints(int count, const int *index, const vec3 *c);
+
+    unsigned char mask(int i, int t) const {
+        return (selector[i] >> (2 * t)) & 0x3;
+    }
+
+    // quantizes the endpoints of blocks [first, first + count) to 565 and back
+    void quantize(int first, int count);
+
+    // same as CompressedImage::computePerBlockError() for the given active
+    // blocks, out[i] receives the error of b[i]
+    void blockError(const Image& img, const ActiveBlock *b, int count, BlockErrorData *out) const;
+};
+
+#endif // BLOCK_ARRAYS_H
@@ -0,0 +1,89 @@
+#include "block_cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+bool BlockCache::Key::operator==(const Key& other) const
+{
+    if (fitMask != other.fitMask)
+        return false;
+    for (int i = 0; i < 16; ++i) {
+        if (texels[i] != other.texels[i])
+            return false;
+    }
+    return true;
+}
+
+// FNV-1a over the texels rounded to 8 bits and the fit mask
+size_t BlockCache::KeyHash::operator()(const Key& key) const
+{
+    uint64_t h = 14695981039346656037ull;
+    auto add = [&h](uint8_t byte) {
+        h ^= byte;
+        h *= 1099511628211ull;
+    };
+    for (int i = 0; i < 16; ++i) {
+        for (int k = 0; k < 3; ++k)
+            add(uint8_t(std::min(std::max(std::round(key.texels[i][k]), 0.0f), 255.0f)));
+    }
+    add(key.fitMask & 0xff);
+    add(key.fitMask >> 8);
+    return size_t(h);
+}
+
+BlockCache::BlockCache(int maxEntries)
+    : lookups{0}, hits{0}, entries{0}, maxEntries{maxEntries}
+{
+}
+
+void BlockCache::clear()
+{
+    for (Shard& s : shard) {
+        std::lock_guard<std::mutex> lock(s.mtx);
+        s.map.clear();
+    }
+    lookups = 0;
+    hits = 0;
+    entries = 0;
+}
+
+BlockCache::Key BlockCache::makeKey(const vec3 *texels, uint16_t fitMask)
+{
+    Key key;
+    std::memcpy(key.texels, texels, sizeof(key.texels));
+    key.fitMask = fitMask;
+    return key;
+}
+
+bool BlockCache::lookup(const vec3 *texels, uint16_t fitMask, Block& blk)
+{
+    Key key = makeKey(texels, fitMask);
+    size_t h = KeyHash()(key);
+    Shard& s = shard[h % NUM_SHARDS];
+
+    lookups++;
+
+    std::lock_guard<std::mutex> lock(s.mtx);
+    auto it = s.map.find(key);
+    if (it == s.map.end())
+        return false;
+
+    blk = it->second;
+    hits++;
+    return true;
+}
+
+void BlockCache::insert(const vec3 *texels, uint16_t fitMask, const Block& blk)
+{
+    if (entries >= maxEntries)
+        return;
+
+    Key key = makeKey(texels, fitMask);
+    size_t h = KeyHash()(key);
+    Shard& s = shard[h % NUM_SHARDS];
+
+    std::lock_guard<std::mutex> lock(s.mtx);
+    if (s.map.insert(std::make_pair(key, blk)).second)
+        entries++;
+}
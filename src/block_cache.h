@@ -0,0 +1,64 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include "compressed_image.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+/* Cache of encoded blocks, keyed on the 16 texels of a block and the mask of the
+ * texels that take part in the endpoint fit. Used by CompressedImage::initialize()
+ * to encode repeated 4x4 tiles only once.
+ *
+ * The hash is computed from the texels rounded to 8 bits, but lookups only hit
+ * if the texels are exactly equal to the cached ones, so a hit always returns
+ * the block the encoder would have produced (and the result does not depend on
+ * the order in which threads fill the cache). The cache is split in shards, each
+ * with its own lock, and stops growing after maxEntries blocks */
+class BlockCache
+{
+    struct Key {
+        vec3 texels[16];
+        uint16_t fitMask;
+
+        bool operator==(const Key& other) const;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<Key, Block, KeyHash> map;
+    };
+
+    static const int NUM_SHARDS = 64;
+
+    Shard shard[NUM_SHARDS];
+
+    std::atomic<uint64_t> lookups;
+    std::atomic<uint64_t> hits;
+    std::atomic<int> entries;
+    int maxEntries;
+
+    static Key makeKey(const vec3 *texels, uint16_t fitMask);
+
+public:
+
+    explicit BlockCache(int maxEntries = 1 << 20);
+
+    void clear();
+
+    bool lookup(const vec3 *texels, uint16_t fitMask, Block& blk);
+    void insert(const vec3 *texels, uint16_t fitMask, const Block& blk);
+
+    uint64_t numLookups() const { return lookups; }
+    uint64_t numHits() const { return hits; }
+    double hitRate() const { return lookups > 0 ? double(hits) / double(lookups) : 0.0; }
+};
+
+#endif // BLOCK_CACHE_H
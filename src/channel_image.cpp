@@ -0,0 +1,241 @@
+#include "channel_image.h"
+#include "image.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+// interpolation weight of e1, indexed by the 3 bit index
+static const float W1[8] = { 0.0f, 1.0f, 1.0f / 7.0f, 2.0f / 7.0f, 3.0f / 7.0f, 4.0f / 7.0f, 5.0f / 7.0f, 6.0f / 7.0f };
+
+static void assignIndices(const float *v, ChannelBlock& cb);
+static void fitChannel(const float *v, uint16_t fitMask, ChannelBlock& cb);
+static CompressedChannelBlock compressChannel(const ChannelBlock& cb);
+
+float ChannelCompressedImage::getWeight(unsigned char bitmask)
+{
+    assert(bitmask < 8);
+    return W1[bitmask];
+}
+
+void ChannelCompressedImage::initialize(const Image& img, uint8_t bitmask)
+{
+    assert(img.resx % 4 == 0);
+    assert(img.resy % 4 == 0);
+
+    resx = img.resx;
+    resy = img.resy;
+
+    const int nch = channels();
+    const int bw = resx / 4;
+    data.resize(nblk() * nch);
+
+    ThreadPool::instance().parallelFor(resy / 4, [&](int y) {
+        for (int x = 0; x < bw; ++x) {
+            vec3 texels[16];
+            uint8_t masks[16];
+            img.readBlock(x, y, texels);
+            img.readBlockMask(x, y, masks);
+
+            float v[2][16];
+            uint16_t fit = 0;
+            for (int t = 0; t < 16; ++t) {
+                for (int ch = 0; ch < nch; ++ch)
+                    v[ch][t] = texels[t][ch];
+                if ((!bitmask) || (masks[t] & bitmask))
+                    fit |= (1 << t);
+            }
+            for (int ch = 0; ch < nch; ++ch)
+                fitChannel(v[ch], fit, data[(y * bw + x) * nch + ch]);
+        }
+    });
+}
+
+void ChannelCompressedImage::quantizeBlocks()
+{
+    for (ChannelBlock& cb : data) {
+        assert(cb.e0 >= 0 && cb.e1 >= 0);
+        cb.e0 = std::min(std::round(cb.e0), 255.0f);
+        cb.e1 = std::min(std::round(cb.e1), 255.0f);
+    }
+}
+
+unsigned ChannelCompressedImage::nblk() const
+{
+    return (resx / 4) * (resy / 4);
+}
+
+int ChannelCompressedImage::getBlockIndex(int x, int y) const
+{
+    return (y / 4) * (resx / 4) + (x / 4);
+}
+
+float ChannelCompressedImage::getEndpoint(int i, int ch, int ci) const
+{
+    const ChannelBlock& cb = data[i * channels() + ch];
+    return (ci == 0) ? cb.e0 : cb.e1;
+}
+
+unsigned char ChannelCompressedImage::getMask(int x, int y, int ch) const
+{
+    x = wrapCoord(x, resx);
+    y = wrapCoord(y, resy);
+    return data[getBlockIndex(x, y) * channels() + ch].bit[(y % 4) * 4 + (x % 4)];
+}
+
+void ChannelCompressedImage::setBlockValues(int n, const int *index, const float *v)
+{
+    for (int i = 0; i < n; ++i) {
+        ChannelBlock& cb = data[index[i] / 2];
+        if (index[i] % 2 == 0)
+            cb.e0 = v[i];
+        else
+            cb.e1 = v[i];
+    }
+}
+
+float ChannelCompressedImage::value(int x, int y, int ch) const
+{
+    x = wrapCoord(x, resx);
+    y = wrapCoord(y, resy);
+    const ChannelBlock& cb = data[getBlockIndex(x, y) * channels() + ch];
+    float w = W1[cb.bit[(y % 4) * 4 + (x % 4)]];
+    return (1.0f - w) * cb.e0 + w * cb.e1;
+}
+
+vec3 ChannelCompressedImage::pixel(int x, int y) const
+{
+    vec3 c(0);
+    for (int ch = 0; ch < channels(); ++ch)
+        c[ch] = value(x, y, ch);
+    return c;
+}
+
+void ChannelCompressedImage::decodeTo(Image& img) const
+{
+    // texels are written from several threads, which a Packed image does not allow
+    img = Image(Image::Float, img.layout());
+    img.resize(resx, resy);
+    assert(img.storage() == Image::Float);
+    ThreadPool::instance().parallelFor(resy, [&](int y) {
+        for (int x = 0; x < resx; ++x)
+            img.pixel(x, y) = pixel(x, y);
+    });
+}
+
+std::vector<uint8_t> ChannelCompressedImage::toDDS() const
+{
+    uint32_t dwMagic = 0x20534444;
+    DDS_HEADER dwHeader = CompressedImage::generateHeader(resx, resy, 1, (format_ == BC4) ? FOURCC_ATI1 : FOURCC_ATI2);
+
+    size_t offset = sizeof(uint32_t) + sizeof(DDS_HEADER);
+    std::vector<uint8_t> bytes(offset + data.size() * sizeof(CompressedChannelBlock));
+    std::memcpy(bytes.data(), &dwMagic, sizeof(uint32_t));
+    std::memcpy(bytes.data() + sizeof(uint32_t), &dwHeader, sizeof(DDS_HEADER));
+
+    // the channels of a BC5 block are stored one after the other, as in data
+    packBlocks(reinterpret_cast<CompressedChannelBlock *>(bytes.data() + offset));
+    return bytes;
+}
+
+void ChannelCompressedImage::packBlocks(CompressedChannelBlock *qb) const
+{
+    ThreadPool::instance().parallelFor(data.size(), [&](int i) {
+        qb[i] = compressChannel(data[i]);
+    });
+}
+
+bool ChannelCompressedImage::save(const char *filename) const
+{
+    return CompressedImage::writeFile(filename, toDDS());
+}
+
+// sets each index to the closest palette entry
+static void assignIndices(const float *v, ChannelBlock& cb)
+{
+    for (int t = 0; t < 16; ++t) {
+        float best = std::numeric_limits<float>::max();
+        for (unsigned char q = 0; q < 8; ++q) {
+            float d = std::abs((1.0f - W1[q]) * cb.e0 + W1[q] * cb.e1 - v[t]);
+            if (d < best) {
+                best = d;
+                cb.bit[t] = q;
+            }
+        }
+    }
+}
+
+// v holds the 16 values of a block channel, by row. The endpoints start at the
+// range of the values in fitMask, and are refit once by least squares
+static void fitChannel(const float *v, uint16_t fitMask, ChannelBlock& cb)
+{
+    if (fitMask == 0) {
+        cb = ChannelBlock{0, 0, {}};
+        return;
+    }
+
+    float lo = std::numeric_limits<float>::max();
+    float hi = std::numeric_limits<float>::lowest();
+    for (int t = 0; t < 16; ++t) {
+        if (fitMask & (1 << t)) {
+            lo = std::min(lo, v[t]);
+            hi = std::max(hi, v[t]);
+        }
+    }
+
+    cb.e0 = hi;
+    cb.e1 = lo;
+    if (hi == lo) {
+        std::memset(cb.bit, 0, sizeof(cb.bit));
+        return;
+    }
+    assignIndices(v, cb);
+
+    // normal equations of min sum ((1 - w) e0 + w e1 - v)^2 over fitMask
+    double a00 = 0, a01 = 0, a11 = 0, b0 = 0, b1 = 0;
+    for (int t = 0; t < 16; ++t) {
+        if (fitMask & (1 << t)) {
+            double w = W1[cb.bit[t]];
+            a00 += (1 - w) * (1 - w);
+            a01 += (1 - w) * w;
+            a11 += w * w;
+            b0 += (1 - w) * v[t];
+            b1 += w * v[t];
+        }
+    }
+    double det = a00 * a11 - a01 * a01;
+    if (std::abs(det) > 1e-6) {
+        cb.e0 = float(glm::clamp((a11 * b0 - a01 * b1) / det, 0.0, 255.0));
+        cb.e1 = float(glm::clamp((a00 * b1 - a01 * b0) / det, 0.0, 255.0));
+        assignIndices(v, cb);
+    }
+}
+
+// rounds the endpoints and orders them for the 8 value mode (e0 > e1), the
+// indices are remapped to the swapped palette if needed
+static CompressedChannelBlock compressChannel(const ChannelBlock& cb)
+{
+    CompressedChannelBlock qb;
+    qb.e0 = uint8_t(glm::clamp(std::round(cb.e0), 0.0f, 255.0f));
+    qb.e1 = uint8_t(glm::clamp(std::round(cb.e1), 0.0f, 255.0f));
+
+    unsigned char remap[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    if (qb.e0 < qb.e1) {
+        std::swap(qb.e0, qb.e1);
+        unsigned char swapped[8] = { 1, 0, 7, 6, 5, 4, 3, 2 };
+        std::memcpy(remap, swapped, sizeof(remap));
+    } else if (qb.e0 == qb.e1) {
+        // the 6 value mode, all the interpolated entries are the endpoint
+        std::memset(remap, 0, sizeof(remap));
+    }
+
+    uint64_t index = 0;
+    for (int t = 0; t < 16; ++t)
+        index |= uint64_t(remap[cb.bit[t]]) << (3 * t);
+    for (int k = 0; k < 6; ++k)
+        qb.index[k] = uint8_t(index >> (8 * k));
+    return qb;
+}
@@ -0,0 +1,93 @@
+#ifndef CHANNEL_IMAGE_H
+#define CHANNEL_IMAGE_H
+
+#include "compressed_image.h"
+
+#include <cstdint>
+#include <vector>
+
+class Image;
+
+const uint32_t FOURCC_ATI1 = 0x31495441; // 'ATI1' (BC4)
+const uint32_t FOURCC_ATI2 = 0x32495441; // 'ATI2' (BC5)
+
+/* One channel of a BC4 block. The 3 bit indices keep the meaning they have in
+ * the 8 value mode (0 is e0, 1 is e1, 2 to 7 go from e0 to e1 in steps of 1/7)
+ * whatever the order of the endpoints, which is only fixed when the blocks are
+ * written */
+struct ChannelBlock {
+    float e0;
+    float e1;
+    unsigned char bit[16];
+};
+
+typedef struct __attribute__ ((packed)) {
+    uint8_t e0;
+    uint8_t e1;
+    uint8_t index[6]; // 3 bits per texel, least significant bits first
+} CompressedChannelBlock;
+
+class ChannelCompressedImage {
+
+public:
+
+    /* BC4 stores the red channel of the image, BC5 the red and green channels
+     * (e.g. the x and y components of a tangent space normal map) */
+    enum Format {
+        BC4,
+        BC5
+    };
+
+    // interpolation weight of e1, indexed by the 3 bit index
+    static float getWeight(unsigned char bitmask);
+
+private:
+
+    Format format_;
+
+    void packBlocks(CompressedChannelBlock *qb) const;
+
+public:
+
+    // channel ch of block i is data[i * channels() + ch]
+    std::vector<ChannelBlock> data;
+
+    int resx;
+    int resy;
+
+    explicit ChannelCompressedImage(Format format = BC4) : format_{format}, resx{0}, resy{0} {}
+
+    Format format() const { return format_; }
+    int channels() const { return (format_ == BC4) ? 1 : 2; }
+
+    void initialize(const Image& img, uint8_t bitmask);
+
+    /* (virtual) 8 bit quantization of block endpoints */
+    void quantizeBlocks();
+
+    unsigned nblk() const;
+    int getBlockIndex(int x, int y) const;
+
+    float getEndpoint(int i, int ch, int ci) const;
+    unsigned char getMask(int x, int y, int ch) const;
+
+    /* sets n endpoints at once, endpoint ci of channel ch of block bi has
+     * index (bi * channels() + ch) * 2 + ci */
+    void setBlockValues(int n, const int *index, const float *v);
+
+    float value(int x, int y, int ch) const;
+
+    /* the decoded channels in the first components, the others are 0 */
+    vec3 pixel(int x, int y) const;
+
+    /* img is reset to Float storage as in CompressedImage::decodeTo() */
+    void decodeTo(Image& img) const;
+
+    /* the DDS file (header and BC4 or BC5 blocks) as written by save() */
+    std::vector<uint8_t> toDDS() const;
+
+    /* returns false if the file could not be written */
+    bool save(const char *filename) const;
+};
+
+#endif // CHANNEL_IMAGE_H
@@ -1,44 +1,135 @@
 #include "compressed_image.h"
+#include "active_set.h"
+#include "bc1_kernel.h"
+#include "block_cache.h"
 #include "image.h"
 #include "line.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstring>
 #include <fstream>
+#include <iterator>
+#include <limits>
 
 #include <glm/geometric.hpp>
+#include <glm/vector_relational.hpp>
 
-#include <Eigen/Core>
-#include <Eigen/Dense>
+#if defined(__SSE2__) && !defined(__EMSCRIPTEN__)
+#define COMPRESSED_IMAGE_SSE2
+#include <emmintrin.h>
+#endif
+
+
+typedef std::array<vec3, 16> ColorBlock;
+
+enum BlockClass {
+    EmptyBlock,     // no texel takes part in the fit
+    ConstantBlock,  // a single color
+    TwoColorBlock,  // exactly two colors
+    ComplexBlock
+};
 
+// optimal quantized endpoints to reproduce an 8 bit value with the 2/3 1/3 palette entry
+struct SingleColorEntry {
+    uint8_t e0;
+    uint8_t e1;
+};
 
-static CompressedBlock compressBlock(const Block& blk);
-static float optimizeEndpoints(const std::vector<vec3>& cblk, const std::vector<uint8_t>& mblk, Block& blk);
-static void findColorInterval(const std::vector<vec3>& cblk, const Line3& line, vec3& c0, vec3& c1);
-static unsigned char getQuantizationMask(const vec3& color, const vec3& c0, const vec3& c1);
+static_assert(sizeof(ColorBlock) == 16 * sizeof(vec3), "ColorBlock arrays must be contiguous");
+
+static CompressedBlock compressBlock(const PackedBlock& pb);
+
+static const uint32_t SPARSE_MAGIC = ((uint32_t)('S')) | ((uint32_t)('B') << 8) | ((uint32_t)('C') << 16) | ((uint32_t)('1') << 24);
+static bool expandBlock(const CompressedBlock& cb, PackedBlock& pb);
+static void findColorInterval(const vec3 *cblk, unsigned n, const Line3& line, vec3& c0, vec3& c1);
 static unsigned char swappedMask(unsigned char mask);
-static Block computeBlock(const std::vector<vec3>& cblk, const std::vector<uint8_t>& mblk, uint8_t bitmask);
-static vec3 getColor(const Block& blk, int i);
+static BlockClass classifyBlock(const ColorBlock& cblk, uint16_t fitMask, vec3& a, vec3& b);
+static void fitBlockEndpoints(const ColorBlock& cblk, uint16_t fitMask, Block& blk);
+static void fitBoundingBox(const ColorBlock& cblk, uint16_t fitMask, Block& blk);
+static void fitClusters(const ColorBlock& cblk, uint16_t fitMask, Block& blk);
+static void fitSingleColorEndpoints(const vec3& color, Block& blk);
+static std::array<SingleColorEntry, 256> singleColorTable(int bits);
+static unsigned char getPackedMask(const PackedBlock& pb, int i);
 
 static uint16_t quantizeColor(const vec3& color);
 static vec3 quantized2rgb(uint16_t c);
 
 
+static const char *PRESET_NAMES[] = { "fast", "default", "iterative", "exhaustive" };
+
+const char *CompressedImage::presetName(Preset preset)
+{
+    return PRESET_NAMES[preset];
+}
+
+bool CompressedImage::presetFromName(const char *name, Preset& preset)
+{
+    for (int i = 0; i < 4; ++i) {
+        if (std::strcmp(name, PRESET_NAMES[i]) == 0) {
+            preset = Preset(i);
+            return true;
+        }
+    }
+    return false;
+}
+
 vec2 CompressedImage::getWeights(unsigned char bitmask)
 {
-    switch (bitmask) {
-    case QMASK_C0:
-        return vec2(1, 0);
-    case QMASK_C0_23_C1_13:
-        return vec2(2.0f / 3.0f, 1.0f / 3.0f);
-    case QMASK_C0_13_C1_23:
-        return vec2(1.0f / 3.0f, 2.0f / 3.0f);
-    case QMASK_C1:
-        return vec2(0, 1);
-    default:
-        assert(0 && "getWeights(): invalid bit mask");
+    assert(bitmask < 4 && "getWeights(): invalid bit mask");
+    return vec2(QMASK_W0[bitmask], QMASK_W1[bitmask]);
+}
+
+Block CompressedImage::unpackBlock(const PackedBlock& pb)
+{
+    Block blk;
+    blk.c0 = quantized2rgb(pb.c0);
+    blk.c1 = quantized2rgb(pb.c1);
+    for (int i = 0; i < 16; ++i)
+        blk.bit[i] = getPackedMask(pb, i);
+    return blk;
+}
+
+PackedBlock CompressedImage::packBlock(const Block& blk)
+{
+    PackedBlock pb = {0, 0, 0};
+    pb.c0 = quantizeColor(blk.c0);
+    pb.c1 = quantizeColor(blk.c1);
+    for (unsigned i = 0; i < 16; ++i)
+        pb.index |= (uint32_t(blk.bit[i]) << (2 * i));
+    return pb;
+}
+
+void CompressedImage::storeBlocks(const int *index, const Block *blk, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        if (layout_ == Float)
+            data[index[i]] = blk[i];
+        else if (layout_ == Packed)
+            packed[index[i]] = packBlock(blk[i]);
+        else
+            arrays.set(index[i], blk[i]);
     }
 }
 
+void CompressedImage::setPreset(Preset preset)
+{
+    // cached blocks were encoded with the previous preset
+    if (cache && preset != preset_)
+        cache->clear();
+    preset_ = preset;
+}
+
+void CompressedImage::setBlockCache(bool enable)
+{
+    if (enable && !cache)
+        cache = std::make_shared<BlockCache>();
+    else if (!enable)
+        cache.reset();
+}
+
 void CompressedImage::initialize(const Image& img, uint8_t bitmask)
 {
     assert(img.resx % 4 == 0);
@@ -47,71 +138,207 @@ void CompressedImage::initialize(const Image& img, uint8_t bitmask)
     resx = img.resx;
     resy = img.resy;
 
+    const int bw = resx / 4;
+    const int bh = resy / 4;
+
     data.clear();
-    data.reserve((resx * resy) / 16);
-
-    for (int y = 0; y < resy / 4; ++y)
-    for (int x = 0; x < resx / 4; ++x) {
-        std::vector<vec3> cblk;
-        std::vector<uint8_t> mblk;
-        for (int h = 0; h < 4; ++h)
-        for (int k = 0; k < 4; ++k) {
-            cblk.push_back(img.pixel(4 * x + k, 4 * y + h));
-            mblk.push_back(img.mask(4 * x + k, 4 * y + h));
-        }
-        Block blk = computeBlock(cblk, mblk, bitmask);
-        data.push_back(blk);
-    }
+    packed.clear();
+    arrays.clear();
+    shadow.clear();
+    source.clear();
+    approximated.clear();
+    if (layout_ == Float)
+        data.resize(bw * bh);
+    else if (layout_ == Packed)
+        packed.resize(bw * bh);
+    else
+        arrays.resize(bw * bh);
+
+    if (cache)
+        cache->clear();
+
+    // each row of blocks is encoded independently
+    ThreadPool::instance().parallelFor(bh, [&](int y) {
+        std::vector<int> index(bw);
+        std::vector<Block> row(bw);
+        for (int x = 0; x < bw; ++x)
+            index[x] = y * bw + x;
+        encodeBlocks(img, bitmask, index.data(), bw, row.data());
+        storeBlocks(index.data(), row.data(), bw);
+    });
 }
 
-std::vector<BlockErrorData> CompressedImage::computePerBlockError(const Image& img) const
+void CompressedImage::update(const Image& img, uint8_t bitmask, const ActiveSet& changed)
 {
     assert(resx == img.resx);
     assert(resy == img.resy);
+    assert(resx == changed.resx);
+    assert(resy == changed.resy);
+    assert(shadow.empty() && "update(): quantizeBlocks() must be called first");
+
+    const int chunk = 64;
+    int nchunks = (changed.block.size() + chunk - 1) / chunk;
+    ThreadPool::instance().parallelFor(nchunks, [&](int ci) {
+        int first = ci * chunk;
+        int n = std::min<int>(chunk, changed.block.size() - first);
+        int index[chunk];
+        Block blk[chunk];
+        for (int i = 0; i < n; ++i)
+            index[i] = changed.block[first + i].index;
+        encodeBlocks(img, bitmask, index, n, blk);
+        storeBlocks(index, blk, n);
+    });
+}
+
+// the blocks are classified and their endpoints initialized one at a time, then
+// the kernel computes the indices (and refits the endpoints of complex blocks)
+// of the non empty blocks in batches
+void CompressedImage::encodeBlocks(const Image& img, uint8_t bitmask, const int *index, int count, Block *out) const
+{
+    const int bw = img.resx / 4;
+
+    std::vector<ColorBlock> cblk(count);
+    std::vector<uint16_t> fitMask(count);
+    std::vector<uint16_t> keyMask(count);
+    std::vector<Block> batch(count);
+    std::vector<int> batchIndex;
+
+    for (int j = 0; j < count; ++j) {
+        int x = index[j] % bw;
+        int y = index[j] / bw;
+        int n = batchIndex.size();
+        uint16_t fit = 0;
+        uint8_t masks[16];
+        img.readBlock(x, y, cblk[n].data());
+        img.readBlockMask(x, y, masks);
+        for (int t = 0; t < 16; ++t) {
+            if ((!bitmask) || (masks[t] & bitmask))
+                fit |= (1 << t);
+        }
 
-    std::vector<BlockErrorData> perBlockError;
-    for (int by = 0; by < resy / 4; ++by)
-    for (int bx = 0; bx < resx / 4; ++bx) {
-        std::vector<vec3> cblk;
-        std::vector<uint8_t> mblk;
-        for (int h = 0; h < 4; ++h)
-        for (int k = 0; k < 4; ++k) {
-            cblk.push_back(img.pixel(4 * bx + k, 4 * by + h));
-            mblk.push_back(img.mask(4 * bx + k, 4 * by + h));
+        if (fit != 0 && cache && cache->lookup(cblk[n].data(), fit, out[j]))
+            continue;
+
+        keyMask[n] = fit;
+
+        vec3 a, b;
+        switch (classifyBlock(cblk[n], fit, a, b)) {
+        case EmptyBlock:
+            out[j] = Block{vec3(0), vec3(0), {}};
+            continue;
+        case ConstantBlock:
+            fitSingleColorEndpoints(a, batch[n]);
+            fit = 0;
+            break;
+        case TwoColorBlock:
+            batch[n].c0 = a;
+            batch[n].c1 = b;
+            fit = 0;
+            break;
+        case ComplexBlock:
+            if (preset_ == Fast) {
+                fitBoundingBox(cblk[n], fit, batch[n]);
+                fit = 0;
+            } else if (preset_ == Exhaustive) {
+                fitClusters(cblk[n], fit, batch[n]);
+                fit = 0;
+            } else {
+                fitBlockEndpoints(cblk[n], fit, batch[n]);
+            }
+            break;
         }
+        fitMask[n] = fit;
+        batchIndex.push_back(j);
+    }
+    Bc1Kernel::run(cblk[0].data(), fitMask.data(), batch.data(), nullptr, batchIndex.size());
 
-        int blkIndex = getBlockIndex(4 * bx, 4 * by);
+    // refit the complex blocks until the residual stops decreasing
+    for (unsigned i = 0; preset_ == Iterative && i < batchIndex.size(); ++i) {
+        if (fitMask[i] == 0)
+            continue;
+        Block& blk = batch[i];
+        float rmin = std::numeric_limits<float>::max();
+        while (true) {
+            Block next = blk;
+            float r;
+            Bc1Kernel::runScalar(cblk[i].data(), &fitMask[i], &next, &r, 1);
+            if (r >= rmin)
+                break;
+            rmin = r;
+            blk = next;
+        }
+    }
 
-        float minError = 1e10;
-        float maxError = 0;
-        float totalError = 0;
-        int n = 0;
-        for (unsigned i = 0; i < 16; ++i) {
-            if (mblk[i] & (Image::MaskBit::Internal | Image::MaskBit::Seam)) {
+    for (unsigned i = 0; i < batchIndex.size(); ++i) {
+        out[batchIndex[i]] = batch[i];
+        if (cache)
+            cache->insert(cblk[i].data(), keyMask[i], batch[i]);
+    }
+}
+
+std::vector<BlockErrorData> CompressedImage::computePerBlockError(const Image& img) const
+{
+    return computePerBlockError(img, ActiveSet(img, Image::MaskBit::Internal | Image::MaskBit::Seam));
+}
+
+// blocks that are not in the active set are reported with zero error
+std::vector<BlockErrorData> CompressedImage::computePerBlockError(const Image& img, const ActiveSet& active) const
+{
+    assert(resx == img.resx);
+    assert(resy == img.resy);
+    assert(resx == active.resx);
+    assert(resy == active.resy);
+
+    std::vector<BlockErrorData> perBlockError(nblk());
+    for (unsigned i = 0; i < perBlockError.size(); ++i)
+        perBlockError[i] = {int(i), 0, 0, 0};
+
+    const int chunk = 256;
+    int nchunks = (active.block.size() + chunk - 1) / chunk;
+
+    if (layout_ == SoA) {
+        ThreadPool::instance().parallelFor(nchunks, [&](int ci) {
+            int first = ci * chunk;
+            int n = std::min<int>(chunk, active.block.size() - first);
+            BlockErrorData err[chunk];
+            arrays.blockError(img, &active.block[first], n, err);
+            for (int i = 0; i < n; ++i)
+                perBlockError[err[i].blkIndex] = err[i];
+        });
+        return perBlockError;
+    }
+
+    ThreadPool::instance().parallelFor(nchunks, [&](int ci) {
+        for (unsigned i = ci * chunk; i < std::min<unsigned>((ci + 1) * chunk, active.block.size()); ++i) {
+            const ActiveBlock& b = active.block[i];
+            float minError = 1e10;
+            float maxError = 0;
+            float totalError = 0;
+            int n = 0;
+            vec3 texels[16];
+            decodeBlock(b.index, texels);
+            active.forEachTexel(b, [&](int x, int y) {
                 n++;
-                vec3 c = getColor(data[blkIndex], i);
-                vec3 src = cblk[i];
+                vec3 c = texels[(y % 4) * 4 + (x % 4)];
+                vec3 src = img.pixel(x, y);
                 float dist = glm::distance(c, src);
                 minError = std::min(minError, dist);
                 maxError = std::max(maxError, dist);
                 totalError += dist;
-            }
-        }
+            });
 
-        if (n > 0)
-            perBlockError.push_back({blkIndex, minError, maxError, totalError / n});
-        else
-            perBlockError.push_back({blkIndex, 0, 0, 0});
-    }
+            perBlockError[b.index] = {b.index, minError, maxError, totalError / n};
+        }
+    });
     return perBlockError;
 }
 
-DDS_PIXELFORMAT CompressedImage::generatePixelFormat() const
+DDS_PIXELFORMAT CompressedImage::generatePixelFormat(uint32_t fourCC)
 {
     DDS_PIXELFORMAT pf = {};
     pf.dwSize = 32;
     pf.dwFlags = 0x4; // TODO
-    pf.dwFourCC = ((uint32_t)('D')) | ((uint32_t)('X') << 8) | ((uint32_t)('T') << 16) | ((uint32_t)('1') << 24);
+    pf.dwFourCC = fourCC;
     pf.dwRGBBitCount = 0;
     pf.dwRBitMask = 0;
     pf.dwGBitMask = 0;
@@ -120,47 +347,306 @@ DDS_PIXELFORMAT CompressedImage::generatePixelFormat() const
     return pf;
 }
 
+bool CompressedImage::writeFile(const char *filename, const std::vector<uint8_t>& bytes)
+{
+    std::ofstream out(filename, std::ios::binary);
+    out.write(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+    out.close();
+    return bool(out);
+}
+
 // https://docs.microsoft.com/en-us/windows/win32/direct3ddds/dx-graphics-dds-pguide
-DDS_HEADER CompressedImage::generateHeader() const
+DDS_HEADER CompressedImage::generateHeader(int width, int height, int mipCount, uint32_t fourCC)
 {
     DDS_HEADER header = {};
     // set header
     header.dwSize = 124;
     header.dwFlags = 0x1 | 0x2 | 0x4 | 0x1000; // TODO
-    header.dwHeight = resy;
-    header.dwWidth = resx;
+    header.dwHeight = height;
+    header.dwWidth = width;
     header.dwPitchOrLinearSize = 0;
     header.dwDepth = 0;
-    header.dwMipMapCount = 1;
+    header.dwMipMapCount = mipCount;
     //header.dwReserved1[11] = 0;
     header.dwCaps = 0x1000; // TODO
+    if (mipCount > 1) {
+        header.dwFlags |= 0x20000; // DDSD_MIPMAPCOUNT
+        header.dwCaps |= 0x8 | 0x400000; // DDSCAPS_COMPLEX | DDSCAPS_MIPMAP
+    }
     header.dwCaps2 = 0;
     header.dwCaps3 = 0;
     header.dwCaps4 = 0;
     header.dwReserved2 = 0;
     // set pixelformat structure
-    header.ddspf = generatePixelFormat();
+    header.ddspf = generatePixelFormat(fourCC);
     return header;
 }
 
-void CompressedImage::save(const char *filename) const
+std::vector<uint8_t> CompressedImage::toDDS() const
+{
+    return toDDS(std::vector<const CompressedImage *>(1, this));
+}
+
+std::vector<uint8_t> CompressedImage::toDDS(const std::vector<const CompressedImage *>& levels)
 {
+    assert(!levels.empty());
+
     uint32_t dwMagic = 0x20534444;
-    DDS_HEADER dwHeader = generateHeader();
+    DDS_HEADER dwHeader = generateHeader(levels[0]->resx, levels[0]->resy, levels.size());
+
+    size_t size = sizeof(uint32_t) + sizeof(DDS_HEADER);
+    std::vector<size_t> offset;
+    for (const CompressedImage *level : levels) {
+        offset.push_back(size);
+        size += level->nblk() * sizeof(CompressedBlock);
+    }
+
+    std::vector<uint8_t> bytes(size);
+    std::memcpy(bytes.data(), &dwMagic, sizeof(uint32_t));
+    std::memcpy(bytes.data() + sizeof(uint32_t), &dwHeader, sizeof(DDS_HEADER));
+
+    // CompressedBlock is packed, so the blocks can be written in place
+    for (unsigned l = 0; l < levels.size(); ++l)
+        levels[l]->packBlocks(reinterpret_cast<CompressedBlock *>(bytes.data() + offset[l]));
+
+    return bytes;
+}
+
+// blocks that still hold what load() read are written back with their original bits
+void CompressedImage::packBlocks(CompressedBlock *qb) const
+{
+    const int bw = resx / 4;
+    ThreadPool::instance().parallelFor(resy / 4, [&](int y) {
+        for (int x = 0; x < bw; ++x) {
+            int i = y * bw + x;
+            PackedBlock pb = (layout_ == Packed) ? packed[i] : packBlock(getBlock(i));
+            bool unchanged = false;
+            if (!source.empty()) {
+                PackedBlock lb;
+                expandBlock(source[i], lb);
+                unchanged = (std::memcmp(&lb, &pb, sizeof(PackedBlock)) == 0);
+            }
+            qb[i] = unchanged ? source[i] : compressBlock(pb);
+        }
+    });
+}
+
+bool CompressedImage::save(const char *filename) const
+{
+    return writeFile(filename, toDDS());
+}
+
+bool CompressedImage::save(const char *filename, const std::vector<const CompressedImage *>& levels)
+{
+    return writeFile(filename, toDDS(levels));
+}
+
+bool CompressedImage::load(const char *filename)
+{
+    std::ifstream dds(filename, std::ios::binary);
+    if (!dds)
+        return false;
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(dds)), std::istreambuf_iterator<char>());
+    return fromDDS(bytes.data(), bytes.size());
+}
+
+bool CompressedImage::fromDDS(const uint8_t *bytes, size_t size)
+{
+    const size_t offset = sizeof(uint32_t) + sizeof(DDS_HEADER);
+    if (size < offset)
+        return false;
+
+    uint32_t dwMagic;
+    DDS_HEADER header;
+    std::memcpy(&dwMagic, bytes, sizeof(uint32_t));
+    std::memcpy(&header, bytes + sizeof(uint32_t), sizeof(DDS_HEADER));
+
+    if (dwMagic != 0x20534444 || header.dwSize != 124)
+        return false;
+    if (!(header.ddspf.dwFlags & 0x4) || header.ddspf.dwFourCC != FOURCC_DXT1)
+        return false;
+    if (header.dwWidth == 0 || header.dwHeight == 0 || header.dwWidth % 4 != 0 || header.dwHeight % 4 != 0)
+        return false;
+
+    // only the top level is read
+    size_t n = size_t(header.dwWidth / 4) * size_t(header.dwHeight / 4);
+    if (size < offset + n * sizeof(CompressedBlock))
+        return false;
+
+    std::vector<CompressedBlock> blocks(n);
+    std::memcpy(blocks.data(), bytes + offset, n * sizeof(CompressedBlock));
+    loadBlocks(header.dwWidth, header.dwHeight, blocks);
+
+    return true;
+}
+
+std::vector<uint8_t> CompressedImage::toSparse(const ActiveSet& occupied) const
+{
+    assert(occupied.resx == resx);
+    assert(occupied.resy == resy);
+
+    SPARSE_HEADER header = {};
+    header.magic = SPARSE_MAGIC;
+    header.width = resx;
+    header.height = resy;
+    header.numBlocks = occupied.nblk();
+
+    const size_t offset = sizeof(SPARSE_HEADER) + (nblk() + 7) / 8;
+    std::vector<uint8_t> bytes(sparseSize(occupied));
+    std::memcpy(bytes.data(), &header, sizeof(SPARSE_HEADER));
+
+    std::vector<CompressedBlock> qb(nblk());
+    packBlocks(qb.data());
+
+    // the occupied blocks are stored in block order after the bitmap
+    uint8_t *bitmap = bytes.data() + sizeof(SPARSE_HEADER);
+    CompressedBlock *out = reinterpret_cast<CompressedBlock *>(bytes.data() + offset);
+    for (const ActiveBlock& b : occupied.block) {
+        bitmap[b.index / 8] |= (1 << (b.index % 8));
+        *out++ = qb[b.index];
+    }
+
+    return bytes;
+}
+
+size_t CompressedImage::sparseSize(const ActiveSet& occupied) const
+{
+    return sizeof(SPARSE_HEADER) + (nblk() + 7) / 8 + occupied.nblk() * sizeof(CompressedBlock);
+}
+
+size_t CompressedImage::ddsSize() const
+{
+    return sizeof(uint32_t) + sizeof(DDS_HEADER) + nblk() * sizeof(CompressedBlock);
+}
+
+bool CompressedImage::saveSparse(const char *filename, const ActiveSet& occupied) const
+{
+    return writeFile(filename, toSparse(occupied));
+}
+
+bool CompressedImage::loadSparse(const char *filename)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        return false;
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    return fromSparse(bytes.data(), bytes.size());
+}
+
+bool CompressedImage::fromSparse(const uint8_t *bytes, size_t size)
+{
+    if (size < sizeof(SPARSE_HEADER))
+        return false;
+
+    SPARSE_HEADER header;
+    std::memcpy(&header, bytes, sizeof(SPARSE_HEADER));
+
+    if (header.magic != SPARSE_MAGIC)
+        return false;
+    if (header.width == 0 || header.height == 0 || header.width % 4 != 0 || header.height % 4 != 0)
+        return false;
+
+    size_t n = size_t(header.width / 4) * size_t(header.height / 4);
+    const size_t bitmapSize = (n + 7) / 8;
+    const size_t offset = sizeof(SPARSE_HEADER) + bitmapSize;
+    if (header.numBlocks > n || size < offset + header.numBlocks * sizeof(CompressedBlock))
+        return false;
+
+    // empty blocks decode to black, as written by initialize()
+    std::vector<CompressedBlock> blocks(n, CompressedBlock{0, 0, 0});
+    const uint8_t *bitmap = bytes + sizeof(SPARSE_HEADER);
+    const uint8_t *in = bytes + offset;
+    unsigned k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            if (k == header.numBlocks)
+                return false;
+            std::memcpy(&blocks[i], in + k * sizeof(CompressedBlock), sizeof(CompressedBlock));
+            k++;
+        }
+    }
+    if (k != header.numBlocks)
+        return false;
+
+    loadBlocks(header.width, header.height, blocks);
+
+    return true;
+}
+
+void CompressedImage::loadBlocks(int width, int height, std::vector<CompressedBlock>& blocks)
+{
+    resx = width;
+    resy = height;
+
+    const int n = blocks.size();
+
+    data.clear();
+    packed.clear();
+    arrays.clear();
+    shadow.clear();
+    if (layout_ == Float)
+        data.resize(n);
+    else if (layout_ == Packed)
+        packed.resize(n);
+    else
+        arrays.resize(n);
+
+    source.swap(blocks);
+
+    approximated.clear();
+    for (int i = 0; i < n; ++i) {
+        PackedBlock pb;
+        if (!expandBlock(source[i], pb))
+            approximated.push_back(i);
+        Block blk = unpackBlock(pb);
+        storeBlocks(&i, &blk, 1);
+    }
+}
+
+bool CompressedImage::encodeToFile(const Image& img, uint8_t bitmask, const char *filename, int bandRows) const
+{
+    assert(img.resx % 4 == 0);
+    assert(img.resy % 4 == 0);
+
+    const int bw = img.resx / 4;
+    const int bh = img.resy / 4;
+
+    if (bandRows <= 0)
+        bandRows = 4 * ThreadPool::instance().numThreads();
 
     std::ofstream dds(filename, std::ios::binary);
+    if (!dds)
+        return false;
+
+    uint32_t dwMagic = 0x20534444;
+    DDS_HEADER dwHeader = generateHeader(img.resx, img.resy, 1);
     dds.write(reinterpret_cast<char *>(&dwMagic), sizeof(uint32_t));
     dds.write(reinterpret_cast<char *>(&dwHeader), sizeof(DDS_HEADER));
-    for (const Block& blk : data) {
-        CompressedBlock qb = compressBlock(blk);
-        dds.write(reinterpret_cast<char *>(&qb), sizeof(CompressedBlock));
+
+    // the blocks are packed straight from the encoder output, quantizing the
+    // endpoints here gives the same bits as quantizeBlocks() followed by save()
+    std::vector<CompressedBlock> band(bandRows * bw);
+    for (int y0 = 0; y0 < bh && dds; y0 += bandRows) {
+        int rows = std::min(bandRows, bh - y0);
+        ThreadPool::instance().parallelFor(rows, [&](int r) {
+            std::vector<int> index(bw);
+            std::vector<Block> row(bw);
+            for (int x = 0; x < bw; ++x)
+                index[x] = (y0 + r) * bw + x;
+            encodeBlocks(img, bitmask, index.data(), bw, row.data());
+            for (int x = 0; x < bw; ++x)
+                band[r * bw + x] = compressBlock(packBlock(row[x]));
+        });
+        dds.write(reinterpret_cast<char *>(band.data()), rows * bw * sizeof(CompressedBlock));
     }
+
     dds.close();
+    return bool(dds);
 }
 
 unsigned CompressedImage::nblk() const
 {
-    return data.size();
+    return (resx / 4) * (resy / 4);
 }
 
 int CompressedImage::getBlockIndex(int x, int y) const
@@ -168,81 +654,231 @@ int CompressedImage::getBlockIndex(int x, int y) const
     return (y/4) * (resx/4) + (x/4);
 }
 
-Block& CompressedImage::getBlock(int x, int y)
+Block CompressedImage::getBlock(int x, int y) const
 {
-    return data[getBlockIndex(x, y)];
+    return getBlock(getBlockIndex(x, y));
 }
 
-const Block& CompressedImage::getBlock(int x, int y) const
+Block CompressedImage::getBlock(int i) const
 {
-    return data[getBlockIndex(x, y)];
+    if (layout_ == Float)
+        return data[i];
+    else if (layout_ == SoA)
+        return arrays.get(i);
+
+    Block blk = unpackBlock(packed[i]);
+    if (!shadow.empty()) {
+        auto it = shadow.find(i);
+        if (it != shadow.end()) {
+            blk.c0 = it->second.c0;
+            blk.c1 = it->second.c1;
+        }
+    }
+    return blk;
 }
 
-Block& CompressedImage::getBlock(int i)
+vec3 CompressedImage::getEndpoint(int i, int ci) const
 {
-    return data[i];
+    if (layout_ == Float)
+        return ci == 0 ? data[i].c0 : data[i].c1;
+    else if (layout_ == SoA)
+        return arrays.endpoint(i, ci);
+
+    if (!shadow.empty()) {
+        auto it = shadow.find(i);
+        if (it != shadow.end())
+            return ci == 0 ? it->second.c0 : it->second.c1;
+    }
+    return quantized2rgb(ci == 0 ? packed[i].c0 : packed[i].c1);
 }
 
 unsigned char CompressedImage::getMask(int x, int y) const
 {
-    x = (x + resx) % resx;
-    y = (y + resy) % resy;
-    const Block& blk = getBlock(x, y);
-    return blk.bit[(y % 4) * 4 + (x % 4)];
+    x = wrapCoord(x, resx);
+    y = wrapCoord(y, resy);
+    int t = (y % 4) * 4 + (x % 4);
+    if (layout_ == Float)
+        return data[getBlockIndex(x, y)].bit[t];
+    else if (layout_ == SoA)
+        return arrays.mask(getBlockIndex(x, y), t);
+    else
+        return getPackedMask(packed[getBlockIndex(x, y)], t);
 }
 
 void CompressedImage::setBlockColor(int bx, int by, int ci, vec3 c)
 {
-    int bi = by * (resx/4) + (bx);
-    if (ci == 0)
-        data[bi].c0 = c;
-    else
-        data[bi].c1 = c;
+    setEndpoint(by * (resx/4) + (bx), ci, c);
+}
+
+void CompressedImage::setBlockColors(int n, const int *index, const vec3 *c)
+{
+    if (layout_ == SoA) {
+        arrays.setEndpoints(n, index, c);
+        return;
+    }
+    for (int i = 0; i < n; ++i)
+        setEndpoint(index[i] / 2, index[i] % 2, c[i]);
+}
+
+void CompressedImage::setEndpoint(int bi, int ci, const vec3& c)
+{
+    if (layout_ == Float) {
+        if (ci == 0)
+            data[bi].c0 = c;
+        else
+            data[bi].c1 = c;
+    } else if (layout_ == SoA) {
+        arrays.setEndpoint(bi, ci, c);
+    } else {
+        auto it = shadow.find(bi);
+        if (it == shadow.end())
+            it = shadow.insert(std::make_pair(bi, Endpoints{getEndpoint(bi, 0), getEndpoint(bi, 1)})).first;
+        if (ci == 0)
+            it->second.c0 = c;
+        else
+            it->second.c1 = c;
+    }
+}
+
+void CompressedImage::getBlockData(int i, vec3& c0, vec3& c1, uint32_t& index) const
+{
+    c0 = getEndpoint(i, 0);
+    c1 = getEndpoint(i, 1);
+    index = getIndices(i);
+}
+
+uint32_t CompressedImage::getIndices(int i) const
+{
+    if (layout_ == Packed)
+        return packed[i].index;
+    else if (layout_ == SoA)
+        return arrays.selector[i];
+
+    uint32_t index = 0;
+    for (int t = 0; t < 16; ++t)
+        index |= (uint32_t(data[i].bit[t]) << (2 * t));
+    return index;
+}
+
+void CompressedImage::decodeBlock(int i, vec3 *texels) const
+{
+    vec3 c0, c1;
+    uint32_t index;
+    getBlockData(i, c0, c1, index);
+
+    // same operations as glm::mix(c0, c1, w) in pixel()
+#ifdef COMPRESSED_IMAGE_SSE2
+    __m128 v0 = _mm_setr_ps(c0.x, c0.y, c0.z, 0.0f);
+    __m128 v1 = _mm_setr_ps(c1.x, c1.y, c1.z, 0.0f);
+    __m128 palette[4];
+    for (int k = 0; k < 4; ++k)
+        palette[k] = _mm_add_ps(_mm_mul_ps(v0, _mm_set1_ps(1.0f - QMASK_W1[k])), _mm_mul_ps(v1, _mm_set1_ps(QMASK_W1[k])));
+
+    // each store writes one texel and spills one float in the next, which is
+    // overwritten by the following store
+    float *out = &texels[0].x;
+    for (int t = 0; t < 15; ++t)
+        _mm_storeu_ps(out + 3 * t, palette[(index >> (2 * t)) & 0x3]);
+    float last[4];
+    _mm_storeu_ps(last, palette[index >> 30]);
+    texels[15] = vec3(last[0], last[1], last[2]);
+#else
+    vec3 palette[4];
+    for (int k = 0; k < 4; ++k)
+        palette[k] = glm::mix(c0, c1, QMASK_W1[k]);
+    for (int t = 0; t < 16; ++t)
+        texels[t] = palette[(index >> (2 * t)) & 0x3];
+#endif
+}
+
+void CompressedImage::decodeTo(Image& img) const
+{
+    // texels are written from several threads, which a Packed image does not allow
+    img = Image(Image::Float, img.layout());
+    img.resize(resx, resy);
+    assert(img.storage() == Image::Float);
+
+    const int bw = resx / 4;
+    ThreadPool::instance().parallelFor(resy / 4, [&](int by) {
+        vec3 texels[16];
+        for (int bx = 0; bx < bw; ++bx) {
+            decodeBlock(by * bw + bx, texels);
+            for (int h = 0; h < 4; ++h)
+            for (int k = 0; k < 4; ++k)
+                img.pixel(4 * bx + k, 4 * by + h) = texels[h * 4 + k];
+        }
+    });
 }
 
 vec3 CompressedImage::pixel(int x, int y) const
 {
-    const Block& blk = getBlock(x, y);
+    int bi = getBlockIndex(wrapCoord(x, resx), wrapCoord(y, resy));
     unsigned char bitmask = getMask(x, y);
     vec2 w = getWeights(bitmask);
-    return glm::mix(blk.c0, blk.c1, w.y);
+    return glm::mix(getEndpoint(bi, 0), getEndpoint(bi, 1), w.y);
 }
 
 void CompressedImage::quantizeBlocks()
 {
-    for (Block& blk : data) {
-
-        assert(blk.c0.r >= 0 && "pre");
-        assert(blk.c0.g >= 0 && "pre");
-        assert(blk.c0.b >= 0 && "pre");
-        assert(blk.c1.r >= 0 && "pre");
-        assert(blk.c1.g >= 0 && "pre");
-        assert(blk.c1.b >= 0 && "pre");
+    if (layout_ == Packed) {
+        // the packed blocks are already quantized, commit the modified ones
+        for (const auto& entry : shadow) {
+            PackedBlock& pb = packed[entry.first];
+            assert(glm::all(glm::greaterThanEqual(entry.second.c0, vec3(0))));
+            assert(glm::all(glm::greaterThanEqual(entry.second.c1, vec3(0))));
+            pb.c0 = quantizeColor(entry.second.c0);
+            pb.c1 = quantizeColor(entry.second.c1);
+        }
+        shadow.clear();
+        return;
+    }
 
-        uint16_t c0 = quantizeColor(blk.c0);
-        uint16_t c1 = quantizeColor(blk.c1);
-        blk.c0 = quantized2rgb(c0);
-        assert(blk.c0.r >= 0);
-        assert(blk.c0.g >= 0);
-        assert(blk.c0.b >= 0);
-        blk.c1 = quantized2rgb(c1);
+    if (layout_ == SoA) {
+        const int chunk = 4096;
+        int nchunks = (nblk() + chunk - 1) / chunk;
+        ThreadPool::instance().parallelFor(nchunks, [&](int ci) {
+            arrays.quantize(ci * chunk, std::min<int>(chunk, nblk() - ci * chunk));
+        });
+        return;
+    }
 
-        assert(blk.c1.r >= 0);
-        assert(blk.c1.g >= 0);
-        assert(blk.c1.b >= 0);
+    const int bw = resx / 4;
+    ThreadPool::instance().parallelFor(resy / 4, [&](int y) {
+        for (int x = 0; x < bw; ++x) {
+            Block& blk = data[y * bw + x];
+
+            assert(blk.c0.r >= 0 && "pre");
+            assert(blk.c0.g >= 0 && "pre");
+            assert(blk.c0.b >= 0 && "pre");
+            assert(blk.c1.r >= 0 && "pre");
+            assert(blk.c1.g >= 0 && "pre");
+            assert(blk.c1.b >= 0 && "pre");
+
+            uint16_t c0 = quantizeColor(blk.c0);
+            uint16_t c1 = quantizeColor(blk.c1);
+            blk.c0 = quantized2rgb(c0);
+            assert(blk.c0.r >= 0);
+            assert(blk.c0.g >= 0);
+            assert(blk.c0.b >= 0);
+            blk.c1 = quantized2rgb(c1);
+
+            assert(blk.c1.r >= 0);
+            assert(blk.c1.g >= 0);
+            assert(blk.c1.b >= 0);
 
-    }
+        }
+    });
 }
 
 
 // -- static functions ---------------------------------------------------------
 
 
-static CompressedBlock compressBlock(const Block& blk)
+static CompressedBlock compressBlock(const PackedBlock& pb)
 {
     CompressedBlock cb = {0, 0, 0};
-    cb.c0 = quantizeColor(blk.c0);
-    cb.c1 = quantizeColor(blk.c1);
+    cb.c0 = pb.c0;
+    cb.c1 = pb.c1;
 
     bool swapped = false;
     if (cb.c0 < cb.c1) {
@@ -253,51 +889,43 @@ static CompressedBlock compressBlock(const Block& blk)
     }
 
     for (unsigned i = 0; i < 16; ++i) {
-        uint32_t mask = swapped ? swappedMask(blk.bit[i]) : blk.bit[i];
+        unsigned char bit = getPackedMask(pb, i);
+        uint32_t mask = swapped ? swappedMask(bit) : bit;
         mask = ((cb.c0 == cb.c1 ? 0 : mask) << (2 * i));
         cb.index |= mask;
     }
     return cb;
 }
 
-static float optimizeEndpoints(const std::vector<vec3>& cblk, const std::vector<uint8_t>& mblk, uint8_t bitmask, Block& blk)
+// converts a block read from a file to the in memory encoding, returns false if
+// the block uses the 3 color mode (c0 <= c1) with the half or transparent entry,
+// that cannot be represented and is replaced by the closest 4 color palette
+static bool expandBlock(const CompressedBlock& cb, PackedBlock& pb)
 {
-    std::vector<int> ind;
-    for (unsigned i = 0; i < cblk.size(); ++i)
-        if ((!bitmask) || (mblk[i] & bitmask))
-           ind.push_back(i);
-
-    Eigen::MatrixXf A(ind.size(), 2);
-    Eigen::MatrixXf B(ind.size(), 3);
-
-    for (unsigned i = 0; i < ind.size(); ++i) {
-        vec2 w = CompressedImage::getWeights(blk.bit[ind[i]]);
-        A.row(i) = Eigen::Vector2f(w.x, w.y);
-        for (int j = 0; j < 3; ++j)
-            B(i, j) = cblk[ind[i]][j];
-    }
-    Eigen::MatrixXf AtA = A.transpose() * A;
-    Eigen::MatrixXf AtB = A.transpose() * B;
-
-    float r = 0;
-
-    for (int j = 0; j < 3; ++j) {
-        Eigen::Vector2f xj = AtA.ldlt().solve(AtB.col(j));
-        blk.c0[j] = xj[0];
-        blk.c1[j] = xj[1];
-
-        Eigen::VectorXf rvec = A * xj - B.col(j);
-
-        r += rvec.squaredNorm();
+    pb.c0 = cb.c0;
+    pb.c1 = cb.c1;
+    pb.index = cb.index;
+
+    if (cb.c0 > cb.c1)
+        return true;
+
+    bool exact = true;
+    // the darker endpoint stands in for transparent black
+    unsigned char dark = (cb.c0 < cb.c1) ? QMASK_C0 : QMASK_C1;
+    for (int i = 0; i < 16; ++i) {
+        unsigned char q = (cb.index >> (2 * i)) & 0x3;
+        if (q == 2 && cb.c0 != cb.c1) {
+            pb.index = (pb.index & ~(0x3u << (2 * i))) | (uint32_t(QMASK_C0_23_C1_13) << (2 * i));
+            exact = false;
+        } else if (q == 3) {
+            pb.index = (pb.index & ~(0x3u << (2 * i))) | (uint32_t(dark) << (2 * i));
+            exact = false;
+        }
     }
-
-    blk.c0 = glm::clamp(blk.c0, vec3(0, 0, 0), vec3(255, 255, 255));
-    blk.c1 = glm::clamp(blk.c1, vec3(0, 0, 0), vec3(255, 255, 255));
-
-    return r;
+    return exact;
 }
 
-static void findColorInterval(const std::vector<vec3>& cblk, const Line3& line, vec3& c0, vec3& c1)
+static void findColorInterval(const vec3 *cblk, unsigned n, const Line3& line, vec3& c0, vec3& c1)
 {
     //float tmin = std::numeric_limits<float>::max();
     //float tmax = std::numeric_limits<float>::lowest();
@@ -307,7 +935,7 @@ static void findColorInterval(const std::vector<vec3>& cblk, const Line3& line,
     float tmin = 0;
     float tmax = 0;
 
-    for (unsigned i = 0; i < cblk.size(); ++i) {
+    for (unsigned i = 0; i < n; ++i) {
         vec3 cvec = cblk[i] - line.o;
         float t = glm::dot(cvec, line.d);
         tmin = std::min(t, tmin);
@@ -317,41 +945,6 @@ static void findColorInterval(const std::vector<vec3>& cblk, const Line3& line,
     c1 = glm::clamp(line(tmax), vec3(0), vec3(255));
 }
 
-static unsigned char getQuantizationMask(const vec3& color, const vec3& c0, const vec3& c1)
-{
-    const float a = 2.0f/3.0f;
-    const float b = 1.0f/3.0f;
-    vec3 c2 = a * c0 + b * c1;
-    vec3 c3 = b * c0 + a * c1;
-
-    float dmin = std::numeric_limits<float>::max();
-    float d;
-    unsigned char mask = 0xff;
-
-    if ((d = distance(color, c0)) < dmin) {
-        dmin = d;
-        mask = QMASK_C0;
-    }
-
-    if ((d = distance(color, c2)) < dmin) {
-        dmin = d;
-        mask = QMASK_C0_23_C1_13;
-    }
-
-    if ((d = distance(color, c3)) < dmin) {
-        dmin = d;
-        mask = QMASK_C0_13_C1_23;
-    }
-
-    if ((d = distance(color, c1)) < dmin) {
-        dmin = d;
-        mask = QMASK_C1;
-    }
-    assert(mask != 0xff);
-
-    return mask;
-}
-
 static unsigned char swappedMask(unsigned char mask)
 {
     switch (mask) {
@@ -368,60 +961,190 @@ static unsigned char swappedMask(unsigned char mask)
     }
 }
 
-#include <iostream>
-// cblk is a 4x4 block of pixels stored by row
-static Block computeBlock(const std::vector<vec3>& cblk, const std::vector<uint8_t> &mblk, uint8_t bitmask)
+// looks at the texels of cblk selected by fitMask. If the block is constant a is
+// set to its color, if it has two colors a and b are set to them
+static BlockClass classifyBlock(const ColorBlock& cblk, uint16_t fitMask, vec3& a, vec3& b)
 {
-    Block blk;
+    if (fitMask == 0)
+        return EmptyBlock;
+
+    int ncolors = 0;
+    for (unsigned bits = fitMask; bits; bits &= bits - 1) {
+        const vec3& c = cblk[__builtin_ctz(bits)];
+        if (ncolors > 0 && c == a)
+            continue;
+        if (ncolors > 1 && c == b)
+            continue;
+        if (ncolors == 2)
+            return ComplexBlock;
+        if (ncolors == 0)
+            a = c;
+        else
+            b = c;
+        ncolors++;
+    }
+    return (ncolors == 1) ? ConstantBlock : TwoColorBlock;
+}
 
-    std::vector<vec3> cblkPosWeight;
-    assert(mblk.size() == 16);
-    for (unsigned i = 0; i < mblk.size(); ++i)
-        if ((!bitmask) || (mblk[i] & bitmask))
-            cblkPosWeight.push_back(cblk[i]);
+// cblk is a 4x4 block of pixels stored by row. Sets the block endpoints to the
+// extremes of the line that best fits the texels in fitMask
+static void fitBlockEndpoints(const ColorBlock& cblk, uint16_t fitMask, Block& blk)
+{
+    std::array<vec3, 16> cblkPosWeight;
+    unsigned n = 0;
+    for (unsigned bits = fitMask; bits; bits &= bits - 1)
+        cblkPosWeight[n++] = cblk[__builtin_ctz(bits)];
 
-    if (cblkPosWeight.size() == 0)
-        //cblkPosWeight.push_back(cblk.front());
-        cblkPosWeight.push_back(vec3(0, 0, 0));
+    assert(n > 0);
 
-    Line3 line = fitLine(cblkPosWeight);
-    findColorInterval(cblkPosWeight, line, blk.c0, blk.c1);
+    Line3 line = fitLine(cblkPosWeight.data(), n);
+    findColorInterval(cblkPosWeight.data(), n, line, blk.c0, blk.c1);
+}
 
-    for (unsigned i = 0; i < 16; ++i) {
-        blk.bit[i] = getQuantizationMask(cblk[i], blk.c0, blk.c1);
+// cblk is a 4x4 block of pixels stored by row. Sets the block endpoints to the
+// corners of the bounding box of the texels in fitMask, choosing the diagonal
+// from the sign of the covariance of each channel with the widest one
+static void fitBoundingBox(const ColorBlock& cblk, uint16_t fitMask, Block& blk)
+{
+    vec3 cmin(255);
+    vec3 cmax(0);
+    vec3 mean(0);
+    int n = 0;
+    for (unsigned bits = fitMask; bits; bits &= bits - 1) {
+        const vec3& c = cblk[__builtin_ctz(bits)];
+        cmin = glm::min(cmin, c);
+        cmax = glm::max(cmax, c);
+        mean += c;
+        n++;
+    }
+    mean /= float(n);
+
+    vec3 range = cmax - cmin;
+    int k = (range.x >= range.y && range.x >= range.z) ? 0 : (range.y >= range.z ? 1 : 2);
+    vec3 cov(0);
+    for (unsigned bits = fitMask; bits; bits &= bits - 1) {
+        vec3 d = cblk[__builtin_ctz(bits)] - mean;
+        cov += d[k] * d;
     }
 
-    if (cblkPosWeight.size() > 2)
-        optimizeEndpoints(cblk, mblk, bitmask, blk);
+    blk.c0 = cmin;
+    blk.c1 = cmax;
+    for (int i = 0; i < 3; ++i) {
+        if (cov[i] < 0)
+            std::swap(blk.c0[i], blk.c1[i]);
+    }
+    blk.c0 = glm::clamp(blk.c0, vec3(0), vec3(255));
+    blk.c1 = glm::clamp(blk.c1, vec3(0), vec3(255));
+}
 
-#if 0
-    // iterative version
-    if (cblkPosWeight.size() > 2) {
-        float rmin = std::numeric_limits<float>::max();
-        while (true) {
-            k++;
-            float r = optimizeEndpoints(cblk, mblk, bitmask, blk);
-            if (r >= rmin) {
-                break;
-            } else {
-                rmin = r;
-                for (unsigned i = 0; i < 16; ++i) {
-                    blk.bit[i] = getQuantizationMask(cblk[i], blk.c0, blk.c1);
-                }
-            }
+// cblk is a 4x4 block of pixels stored by row. Sorts the texels in fitMask
+// along their principal axis and, for every split of the sorted sequence in four
+// (possibly empty) clusters mapped to c0, 2/3 c0 + 1/3 c1, 1/3 c0 + 2/3 c1 and
+// c1, solves for the least squares endpoints. Sets the endpoints with the least
+// squared error
+static void fitClusters(const ColorBlock& cblk, uint16_t fitMask, Block& blk)
+{
+    std::array<vec3, 16> points;
+    unsigned n = 0;
+    for (unsigned bits = fitMask; bits; bits &= bits - 1)
+        points[n++] = cblk[__builtin_ctz(bits)];
+
+    assert(n > 0);
+
+    Line3 line = fitLine(points.data(), n);
+    std::sort(points.begin(), points.begin() + n, [&line](const vec3& p1, const vec3& p2) {
+        return glm::dot(p1 - line.o, line.d) < glm::dot(p2 - line.o, line.d);
+    });
+
+    // prefix sums of the sorted points
+    std::array<dvec3, 17> sum;
+    sum[0] = dvec3(0);
+    double sqsum = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        sum[i + 1] = sum[i] + dvec3(points[i]);
+        sqsum += glm::dot(dvec3(points[i]), dvec3(points[i]));
+    }
+
+    // start from the principal axis endpoints
+    fitBlockEndpoints(cblk, fitMask, blk);
+    double emin = std::numeric_limits<double>::max();
+
+    for (unsigned i = 0; i <= n; ++i)
+    for (unsigned j = 0; i + j <= n; ++j)
+    for (unsigned k = 0; i + j + k <= n; ++k) {
+        unsigned m = n - i - j - k;
+
+        // sums of alpha^2, beta^2, alpha*beta, alpha*x and beta*x where alpha
+        // and beta are the palette weights of c0 and c1
+        double aa = i + j * (4.0 / 9.0) + k * (1.0 / 9.0);
+        double bb = m + j * (1.0 / 9.0) + k * (4.0 / 9.0);
+        double ab = (j + k) * (2.0 / 9.0);
+        dvec3 s0 = sum[i];
+        dvec3 s1 = sum[i + j] - sum[i];
+        dvec3 s2 = sum[i + j + k] - sum[i + j];
+        dvec3 s3 = sum[n] - sum[i + j + k];
+        dvec3 ax = s0 + s1 * (2.0 / 3.0) + s2 * (1.0 / 3.0);
+        dvec3 bx = s1 * (1.0 / 3.0) + s2 * (2.0 / 3.0) + s3;
+
+        double det = aa * bb - ab * ab;
+        if (det <= 1e-8)
+            continue;
+
+        dvec3 c0 = glm::clamp((bb * ax - ab * bx) / det, dvec3(0), dvec3(255));
+        dvec3 c1 = glm::clamp((aa * bx - ab * ax) / det, dvec3(0), dvec3(255));
+
+        double e = sqsum + aa * glm::dot(c0, c0) + bb * glm::dot(c1, c1) + 2 * ab * glm::dot(c0, c1)
+                 - 2 * glm::dot(c0, ax) - 2 * glm::dot(c1, bx);
+        if (e < emin) {
+            emin = e;
+            blk.c0 = vec3(c0);
+            blk.c1 = vec3(c1);
         }
     }
-#endif
+}
 
-    return blk;
+// sets the (already quantized) endpoints that best reproduce color with the
+// QMASK_C0_23_C1_13 palette entry, looking up each channel independently
+static void fitSingleColorEndpoints(const vec3& color, Block& blk)
+{
+    static const std::array<SingleColorEntry, 256> table5 = singleColorTable(5);
+    static const std::array<SingleColorEntry, 256> table6 = singleColorTable(6);
+
+    ivec3 c = glm::clamp(ivec3(glm::round(color)), ivec3(0), ivec3(255));
+    const SingleColorEntry& r = table5[c.r];
+    const SingleColorEntry& g = table6[c.g];
+    const SingleColorEntry& b = table5[c.b];
+    blk.c0 = quantized2rgb((r.e0 << 11) | (g.e0 << 5) | b.e0);
+    blk.c1 = quantized2rgb((r.e1 << 11) | (g.e1 << 5) | b.e1);
+}
+
+// for each 8 bit value, the pair of endpoints with the given number of bits
+// whose 2/3 1/3 interpolation (as computed by pixel()) is closest to it
+static std::array<SingleColorEntry, 256> singleColorTable(int bits)
+{
+    const int qmax = (1 << bits) - 1;
+    const float scale = 255.0f / float(qmax);
+    const float w = CompressedImage::getWeights(QMASK_C0_23_C1_13).y;
+
+    std::array<SingleColorEntry, 256> table;
+    for (int v = 0; v < 256; ++v) {
+        float emin = std::numeric_limits<float>::max();
+        for (int e0 = 0; e0 <= qmax; ++e0)
+        for (int e1 = 0; e1 <= qmax; ++e1) {
+            float p = (e0 * scale) * (1.0f - w) + (e1 * scale) * w;
+            float e = std::abs(p - v);
+            if (e < emin) {
+                emin = e;
+                table[v] = { uint8_t(e0), uint8_t(e1) };
+            }
+        }
+    }
+    return table;
 }
 
-static vec3 getColor(const Block& blk, int i)
+static unsigned char getPackedMask(const PackedBlock& pb, int i)
 {
-    assert(i >= 0);
-    assert(i < 16);
-    vec2 w = CompressedImage::getWeights(blk.bit[i]);
-    return glm::mix(blk.c0, blk.c1, w.y);
+    return (pb.index >> (2 * i)) & 0x3;
 }
 
 static uint16_t quantizeColor_(const vec3& color)
@@ -1,11 +1,19 @@
 #ifndef COMPRESSED_IMAGE_H
 #define COMPRESSED_IMAGE_H
 
+#include "block_arrays.h"
+
 #include <glm/common.hpp>
+#include <glm/vec2.hpp>
 
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 class Image;
+class ActiveSet;
+class BlockCache;
 
 using namespace glm;
 
@@ -37,6 +45,16 @@ typedef struct __attribute__ ((packed)) {
     uint32_t        dwReserved2;
 } DDS_HEADER;
 
+/* Header of the sparse block format: the header is followed by a bitmap with
+ * one bit per block (set if the block is stored, least significant bit first)
+ * and by the CompressedBlocks of the set bits, in block order */
+typedef struct __attribute__ ((packed)) {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t numBlocks;
+} SPARSE_HEADER;
+
 struct Block {
     vec3 c0;
     vec3 c1;
@@ -49,11 +67,25 @@ typedef struct __attribute__ ((packed)) {
     uint32_t index;
 } CompressedBlock;
 
+/* In memory block stored as 565 endpoints and 2 bit indices (not swapped, so
+ * the indices keep the meaning of the QMASK_ values) */
+typedef struct __attribute__ ((packed)) {
+    uint16_t c0;
+    uint16_t c1;
+    uint32_t index;
+} PackedBlock;
+
 const unsigned char QMASK_C0 = 0;
 const unsigned char QMASK_C0_23_C1_13 = 2;
 const unsigned char QMASK_C0_13_C1_23 = 3;
 const unsigned char QMASK_C1 = 1;
 
+// palette weights of c0 and c1, indexed by quantization mask
+const float QMASK_W0[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+const float QMASK_W1[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f };
+
+const uint32_t FOURCC_DXT1 = 0x31545844; // 'DXT1'
+
 struct BlockErrorData {
     int blkIndex;
     float minError;
@@ -65,42 +97,169 @@ class CompressedImage {
 
 public:
 
+    /* Float keeps the blocks in data, Packed keeps them in packed and stores
+     * float endpoints (in shadow) only for the blocks modified by setBlockColor()
+     * since the last call to quantizeBlocks(), SoA keeps them in arrays (one
+     * array per endpoint channel) */
+    enum Layout {
+        Float,
+        Packed,
+        SoA
+    };
+
+    /* Encoder used for the blocks that have more than two colors
+     *  Fast: bounding box of the texels, no refit
+     *  Default: extremes of the principal axis, one least squares refit
+     *  Iterative: like Default, but refits until the residual stops decreasing
+     *  Exhaustive: cluster fit, tries all the orderings of the texels along the
+     *    principal axis */
+    enum Preset {
+        Fast,
+        Default,
+        Iterative,
+        Exhaustive
+    };
+
+    static const char *presetName(Preset preset);
+    static bool presetFromName(const char *name, Preset& preset);
+
     static vec2 getWeights(unsigned char bitmask);
 
+    static Block unpackBlock(const PackedBlock& pb);
+    static PackedBlock packBlock(const Block& blk);
+
+    /* DDS header of a block compressed image, the format is given by fourCC */
+    static DDS_HEADER generateHeader(int width, int height, int mipCount, uint32_t fourCC = FOURCC_DXT1);
+    static DDS_PIXELFORMAT generatePixelFormat(uint32_t fourCC = FOURCC_DXT1);
+
+    /* writes bytes to filename, returns false if the file could not be written */
+    static bool writeFile(const char *filename, const std::vector<uint8_t>& bytes);
+
 private:
 
-    DDS_HEADER generateHeader() const;
-    DDS_PIXELFORMAT generatePixelFormat() const;
+    struct Endpoints {
+        vec3 c0;
+        vec3 c1;
+    };
+
+    Layout layout_;
+    Preset preset_;
+
+    std::unordered_map<int, Endpoints> shadow;
+
+    std::shared_ptr<BlockCache> cache;
+
+    std::vector<CompressedBlock> source; // blocks as read by load() or loadSparse(), written back as is if left unchanged
+    std::vector<int> approximated;
+
+    void loadBlocks(int width, int height, std::vector<CompressedBlock>& blocks);
+    void storeBlocks(const int *index, const Block *blk, int n);
+    void encodeBlocks(const Image& img, uint8_t bitmask, const int *index, int count, Block *out) const;
+    void getBlockData(int i, vec3& c0, vec3& c1, uint32_t& index) const;
+    void setEndpoint(int bi, int ci, const vec3& c);
 
 public:
 
     std::vector<Block> data;
+    std::vector<PackedBlock> packed;
+    BlockArrays arrays;
+
+    CompressedImage() : layout_{Float}, preset_{Default} {}
+    explicit CompressedImage(Layout layout) : layout_{layout}, preset_{Default} {}
+
+    Layout layout() const { return layout_; }
+
+    Preset preset() const { return preset_; }
+    void setPreset(Preset preset);
 
-    CompressedImage() {}
+    /* if enabled, initialize() encodes repeated blocks only once. The cache is
+     * cleared at each initialize(), its counters report the last one */
+    void setBlockCache(bool enable);
+    const BlockCache *blockCache() const { return cache.get(); }
 
     int resx;
     int resy;
 
     void initialize(const Image& img, uint8_t bitmask);
+
+    /* re-encodes only the blocks of changed, the image must differ from the
+     * one this was initialized with only in the texels of changed */
+    void update(const Image& img, uint8_t bitmask, const ActiveSet& changed);
     std::vector<BlockErrorData> computePerBlockError(const Image& img) const;
+    std::vector<BlockErrorData> computePerBlockError(const Image& img, const ActiveSet& active) const;
 
     /* (virtual) 16 bit quantization of block colors */
     void quantizeBlocks();
 
-    void save(const char *filename) const;
+    /* reads the top level of a BC1 DDS file into the blocks, with no decoding or
+     * re-encoding. Blocks that are not modified afterwards are saved with the
+     * same bits they were read with. Returns false if the file is not a DXT1
+     * DDS with sizes multiple of 4 */
+    bool load(const char *filename);
+    bool fromDDS(const uint8_t *bytes, size_t size);
+
+    /* sparse output: only the blocks of occupied are stored, the others are
+     * read back as black blocks */
+    std::vector<uint8_t> toSparse(const ActiveSet& occupied) const;
+    bool saveSparse(const char *filename, const ActiveSet& occupied) const;
+
+    /* sizes in bytes of the sparse and of the (single level) DDS output */
+    size_t sparseSize(const ActiveSet& occupied) const;
+    size_t ddsSize() const;
+    bool loadSparse(const char *filename);
+    bool fromSparse(const uint8_t *bytes, size_t size);
+
+    /* blocks read by load() in the 3 color mode of BC1 that use the half or the
+     * transparent palette entry; in memory they hold the closest 4 color palette */
+    const std::vector<int>& approximatedBlocks() const { return approximated; }
+
+    /* the DDS file (header and BC1 blocks) as written by save() */
+    std::vector<uint8_t> toDDS() const;
+
+    /* packs the nblk() blocks into qb, as they are written to a file */
+    void packBlocks(CompressedBlock *qb) const;
+
+    /* returns false if the file could not be written */
+    bool save(const char *filename) const;
+
+    /* DDS file with a mip chain, levels[0] is the top level and each level must
+     * hold the blocks of the next mip size (at least one block) */
+    static std::vector<uint8_t> toDDS(const std::vector<const CompressedImage *>& levels);
+    static bool save(const char *filename, const std::vector<const CompressedImage *>& levels);
+
+    /* encodes img with the configuration of this object (the blocks of this
+     * object are not touched) and writes it as a DDS file, bandRows rows of
+     * blocks at a time (0 picks a few rows per thread). Only one band is kept
+     * in memory, the file is the same as the one written by initialize(),
+     * quantizeBlocks() and save(). The block cache, if enabled, is used but
+     * not cleared */
+    bool encodeToFile(const Image& img, uint8_t bitmask, const char *filename, int bandRows = 0) const;
     bool saveUncompressed(const char *path) const;
 
     unsigned nblk() const;
     int getBlockIndex(int x, int y) const;
 
-    Block& getBlock(int x, int y);
-    Block& getBlock(int i);
-
-    const Block& getBlock(int x, int y) const;
+    /* blocks are returned by value, decoded if the layout is Packed */
+    Block getBlock(int x, int y) const;
+    Block getBlock(int i) const;
+    vec3 getEndpoint(int i, int ci) const;
 
     unsigned char getMask(int x, int y) const;
 
+    /* the 2 bit indices of block i, texel t in bits [2t, 2t + 1] */
+    uint32_t getIndices(int i) const;
+
+    /* expands the palette of block i once and writes its 16 texels, by row */
+    void decodeBlock(int i, vec3 *texels) const;
+
+    /* decodes the whole image, img is reset to Float storage (keeping its
+     * layout) and its masks are cleared */
+    void decodeTo(Image& img) const;
+
     void setBlockColor(int x, int y, int ci, vec3 c);
+
+    /* sets n endpoints at once, endpoint ci of block bi has index 2 * bi + ci */
+    void setBlockColors(int n, const int *index, const vec3 *c);
     vec3 pixel(int x, int y) const;
 
 
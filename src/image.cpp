@@ -1,9 +1,12 @@
 #include "image.h"
 #include "mesh.h"
+#include "thread_pool.h"
 
+#include <algorithm>
 #include <cmath>
 #include <cassert>
 #include <iostream>
+#include <limits>
 #include <numeric>
 
 #include <glm/common.hpp>
@@ -13,10 +16,97 @@ void Image::resize(int rx, int ry)
 {
     resx = rx;
     resy = ry;
-    data.resize(resx * resy, vec3(0));
+    tilesX = (resx + 4 * TILE_BLOCKS - 1) / (4 * TILE_BLOCKS);
+    if (storage_ == Float) {
+        data.resize(numTexels(), vec3(0));
+    } else {
+        packed.resize(3 * numTexels(), 0);
+        modified.assign(numTexels(), false);
+        overlay.clear();
+    }
     clearMask();
 }
 
+size_t Image::numTexels() const
+{
+    if (layout_ == RowMajor)
+        return size_t(resx) * resy;
+    const int tileSize = 4 * TILE_BLOCKS;
+    int tilesY = (resy + tileSize - 1) / tileSize;
+    return size_t(tilesX) * tilesY * tileSize * tileSize;
+}
+
+void Image::setLayout(Layout layout)
+{
+    if (layout == layout_)
+        return;
+
+    std::vector<vec3> texels(resx * resy);
+    std::vector<uint8_t> masks(resx * resy);
+    for (int y = 0; y < resy; ++y)
+    for (int x = 0; x < resx; ++x) {
+        texels[y * resx + x] = pixel(x, y);
+        masks[y * resx + x] = mask(x, y);
+    }
+
+    layout_ = layout;
+    resize(resx, resy);
+    for (int y = 0; y < resy; ++y)
+    for (int x = 0; x < resx; ++x) {
+        pixel(x, y) = texels[y * resx + x];
+        mask(x, y) = masks[y * resx + x];
+    }
+}
+
+void Image::setStorage(Storage storage)
+{
+    if (storage == storage_)
+        return;
+
+    std::vector<vec3> texels(numTexels());
+    for (unsigned i = 0; i < texels.size(); ++i)
+        texels[i] = texel(i);
+
+    storage_ = storage;
+    data.clear();
+    packed.clear();
+    modified.clear();
+    overlay.clear();
+    if (storage_ == Float) {
+        data.swap(texels);
+    } else {
+        packed.resize(3 * texels.size());
+        modified.assign(texels.size(), false);
+        for (unsigned i = 0; i < texels.size(); ++i)
+            setTexel(i, texels[i]);
+    }
+}
+
+void Image::setTexel(uint i, const vec3& c)
+{
+    if (storage_ == Float) {
+        data[i] = c;
+        return;
+    }
+
+    bool exact = true;
+    for (int k = 0; k < 3; ++k)
+        exact = exact && c[k] >= 0 && c[k] <= 255 && c[k] == std::floor(c[k]);
+
+    if (exact) {
+        packed[3 * i] = uint8_t(c.x);
+        packed[3 * i + 1] = uint8_t(c.y);
+        packed[3 * i + 2] = uint8_t(c.z);
+        if (modified[i]) {
+            overlay.erase(i);
+            modified[i] = false;
+        }
+    } else {
+        overlay[i] = c;
+        modified[i] = true;
+    }
+}
+
 void Image::drawPoint(vec2 p, vec3 c)
 {
     pixel(std::floor(p[0] - 0.5), std::floor(p[1] - 0.5)) = c;
@@ -35,11 +125,72 @@ void Image::drawLine(vec2 from, vec2 to, vec3 c)
 
 }
 
-uint Image::indexOf(int x, int y) const
+// each texel of out covers 2x2 texels of this image (clamped at the border when
+// a size is odd), the masks of out are cleared
+void Image::resampleHalf(Image& out, ResampleMode mode) const
+{
+    out.resize(std::max(1, resx / 2), std::max(1, resy / 2));
+    for (int y = 0; y < out.resy; ++y)
+    for (int x = 0; x < out.resx; ++x) {
+        int x0 = std::min(2 * x, resx - 1);
+        int y0 = std::min(2 * y, resy - 1);
+        if (mode == ResampleMode::Nearest) {
+            out.pixel(x, y) = pixel(x0, y0);
+        } else {
+            int x1 = std::min(2 * x + 1, resx - 1);
+            int y1 = std::min(2 * y + 1, resy - 1);
+            out.pixel(x, y) = 0.25f * (pixel(x0, y0) + pixel(x1, y0) + pixel(x0, y1) + pixel(x1, y1));
+        }
+    }
+}
+
+void Image::readBlock(int bx, int by, vec3 *texels) const
 {
-    x = (x + resx) % resx;
-    y = (y + resy) % resy;
-    return y * resx + x;
+    assert(resx % 4 == 0 && resy % 4 == 0);
+    if (layout_ == Tiled && storage_ == Float) {
+        const vec3 *src = &data[indexOf(4 * bx, 4 * by)];
+        std::copy(src, src + 16, texels);
+        return;
+    }
+    for (int h = 0; h < 4; ++h) {
+        uint i = indexOf(4 * bx, 4 * by + h);
+        for (int k = 0; k < 4; ++k)
+            texels[h * 4 + k] = (layout_ == RowMajor) ? texel(i + k) : texel(indexOf(4 * bx + k, 4 * by + h));
+    }
+}
+
+void Image::readBlockMask(int bx, int by, uint8_t *masks) const
+{
+    assert(resx % 4 == 0 && resy % 4 == 0);
+    if (layout_ == Tiled) {
+        const uint8_t *src = &mask_[indexOf(4 * bx, 4 * by)];
+        std::copy(src, src + 16, masks);
+        return;
+    }
+    for (int h = 0; h < 4; ++h) {
+        const uint8_t *src = &mask_[indexOf(4 * bx, 4 * by + h)];
+        std::copy(src, src + 4, masks + 4 * h);
+    }
+}
+
+void Image::readRow(int y, vec3 *texels) const
+{
+    if (layout_ == RowMajor) {
+        uint i = indexOf(0, y);
+        if (storage_ == Float) {
+            std::copy(&data[i], &data[i] + resx, texels);
+        } else {
+            for (int x = 0; x < resx; ++x)
+                texels[x] = texel(i + x);
+        }
+        return;
+    }
+    // runs of 4 texels, one per block
+    for (int x = 0; x < resx; x += 4) {
+        uint i = indexOf(x, y);
+        for (int k = 0; k < 4 && x + k < resx; ++k)
+            texels[x + k] = texel(i + k);
+    }
 }
 
 
@@ -49,9 +200,22 @@ vec3 Image::pixel(vec2 p) const
     vec2 p0 = floor(p);
     vec2 p1 = floor(p + vec2(1));
     vec2 w = fract(p);
+
+    int x0 = int(p0.x);
+    int y0 = int(p0.y);
+    int x1 = int(p1.x);
+    int y1 = int(p1.y);
+    if (x0 >= 0 && y0 >= 0 && x1 < resx && y1 < resy) {
+        return mix(
+            mix(pixelInterior(x0, y0), pixelInterior(x1, y0), w.x),
+            mix(pixelInterior(x0, y1), pixelInterior(x1, y1), w.x),
+            w.y
+        );
+    }
+
     return mix(
-        mix(pixel(int(p0.x), int(p0.y)), pixel(int(p1.x), int(p0.y)), w.x),
-        mix(pixel(int(p0.x), int(p1.y)), pixel(int(p1.x), int(p1.y)), w.x),
+        mix(pixel(x0, y0), pixel(x1, y0), w.x),
+        mix(pixel(x0, y1), pixel(x1, y1), w.x),
         w.y
     );
 }
@@ -64,13 +228,13 @@ void Image::fetch(vec2 p, vec3& t00, vec3& t10, vec3& t01, vec3& t11,
     vec2 p1 = floor(p + vec2(1));
     vec2 w = fract(p);
 
-    t00 = data[indexOf(int(p0.x), int(p0.y))];
+    t00 = pixel(int(p0.x), int(p0.y));
     w00 = (1 - w.x) * (1 - w.y);
-    t10 = data[indexOf(int(p1.x), int(p0.y))];
+    t10 = pixel(int(p1.x), int(p0.y));
     w10 = (    w.x) * (1 - w.y);
-    t01 = data[indexOf(int(p0.x), int(p1.y))];
+    t01 = pixel(int(p0.x), int(p1.y));
     w01 = (1 - w.x) * (    w.y);
-    t11 = data[indexOf(int(p1.x), int(p1.y))];
+    t11 = pixel(int(p1.x), int(p1.y));
     w11 = (    w.x) * (    w.y);
 }
 
@@ -95,45 +259,146 @@ static inline bool isInside(vec2 l0, vec2 l1, vec2 p)
     return dot(p - l0, n) >= 0;
 }
 
+// uv triangle in texel units, with the texel range that setMaskInternal() tests
+struct RasterTriangle {
+    vec2 v[3];
+    int minx;
+    int miny;
+    int maxx;
+    int maxy;
+};
+
+/* Range [first, last] of the x in [minx, maxx] for which isInside(l0, l1, (x, y))
+ * is true (empty if first > last). Along a row the test is a monotone function
+ * of x, so the range is found by walking from the analytic crossing, with the
+ * same test that is evaluated per texel */
+static void edgeSpan(vec2 l0, vec2 l1, int y, int minx, int maxx, int& first, int& last)
+{
+    vec2 l = l1 - l0;
+    vec2 n(l.y, -l.x);
+
+    if (n.x == 0) {
+        bool in = isInside(l0, l1, vec2(minx, y));
+        first = in ? minx : maxx + 1;
+        last = maxx;
+        return;
+    }
+
+    double xc = double(l0.x) - (double(y) - l0.y) * n.y / n.x;
+    int g = int(std::ceil(glm::clamp(xc, double(minx), double(maxx + 1))));
+
+    if (n.x > 0) {
+        // false, then true
+        while (g > minx && isInside(l0, l1, vec2(g - 1, y)))
+            g--;
+        while (g <= maxx && !isInside(l0, l1, vec2(g, y)))
+            g++;
+        first = g;
+        last = maxx;
+    } else {
+        // true, then false
+        while (g > minx && !isInside(l0, l1, vec2(g - 1, y)))
+            g--;
+        while (g <= maxx && isInside(l0, l1, vec2(g, y)))
+            g++;
+        first = minx;
+        last = g - 1;
+    }
+}
+
+/* A texel is internal if its corner (x, y) is on the same side of the three
+ * edges of a triangle of a face (polygons are split in a fan of triangles).
+ * Each row of a triangle is a span of texels where the three edge tests are
+ * all true or all false. The triangles are binned by bands of rows of the
+ * image, which are rasterized in parallel */
 unsigned Image::setMaskInternal(const Mesh& m)
 {
-    unsigned n = 0;
-    // FIXME does not work with polygonal faces
+    const int BAND_ROWS = 32;
+
     vec2 imgsz(resx, resy);
+    std::vector<RasterTriangle> tri;
     for (const Face& f : m.face) {
-        int minx = std::numeric_limits<int>::max();
-        int miny = std::numeric_limits<int>::max();
-        int maxx = std::numeric_limits<int>::min();
-        int maxy = std::numeric_limits<int>::min();
-        for (unsigned t : f.ti) {
-            vec2 tc = m.vtvec[t] * imgsz;
-            minx = min(minx, int(tc.x));
-            miny = min(miny, int(tc.y));
-            maxx = max(maxx, int(tc.x));
-            maxy = max(maxy, int(tc.y));
+        for (unsigned k = 1; k + 1 < f.ti.size(); ++k) {
+            int t[3] = { f.ti[0], f.ti[k], f.ti[k + 1] };
+            RasterTriangle rt;
+            rt.minx = std::numeric_limits<int>::max();
+            rt.miny = std::numeric_limits<int>::max();
+            rt.maxx = std::numeric_limits<int>::min();
+            rt.maxy = std::numeric_limits<int>::min();
+            for (int i = 0; i < 3; ++i) {
+                rt.v[i] = m.vtvec[t[i]] * imgsz;
+                rt.minx = min(rt.minx, int(rt.v[i].x));
+                rt.miny = min(rt.miny, int(rt.v[i].y));
+                rt.maxx = max(rt.maxx, int(rt.v[i].x));
+                rt.maxy = max(rt.maxy, int(rt.v[i].y));
+            }
+            rt.minx--;
+            rt.miny--;
+            rt.maxx++;
+            rt.maxy++;
+            tri.push_back(rt);
         }
-        minx--;
-        miny--;
-        maxx++;
-        maxy++;
-
-        for (int y = miny; y <= maxy; ++y)
-        for (int x = minx; x <= maxx; ++x) {
-            Edge e0 = f.edge2(0);
-            Edge e1 = f.edge2(1);
-            Edge e2 = f.edge2(2);
-            bool ins0 = isInside(m.vtvec[e0.first] * imgsz, m.vtvec[e0.second] * imgsz, vec2(x, y));
-            bool ins1 = isInside(m.vtvec[e1.first] * imgsz, m.vtvec[e1.second] * imgsz, vec2(x, y));
-            bool ins2 = isInside(m.vtvec[e2.first] * imgsz, m.vtvec[e2.second] * imgsz, vec2(x, y));
-            if ((ins0 == ins1) && (ins1 == ins2)) {
-                if (!(mask(x, y) & MaskBit::Internal)) {
-                    mask(x, y) |= MaskBit::Internal;
-                    n++;
+    }
+
+    // the rows of a triangle can wrap around the image
+    int nbands = (resy + BAND_ROWS - 1) / BAND_ROWS;
+    std::vector<std::vector<int>> bin(nbands);
+    for (unsigned i = 0; i < tri.size(); ++i) {
+        for (int y = tri[i].miny; y <= tri[i].maxy; ++y) {
+            std::vector<int>& b = bin[wrapCoord(y, resy) / BAND_ROWS];
+            if (b.empty() || b.back() != int(i))
+                b.push_back(i);
+        }
+    }
+
+    std::vector<unsigned> count(nbands, 0);
+    ThreadPool::instance().parallelFor(nbands, [&](int band) {
+        for (int i : bin[band]) {
+            const RasterTriangle& rt = tri[i];
+            for (int y = rt.miny; y <= rt.maxy; ++y) {
+                if (wrapCoord(y, resy) / BAND_ROWS != band)
+                    continue;
+
+                // all true and all false spans
+                int inFirst = rt.minx, inLast = rt.maxx;
+                int outFirst = rt.minx, outLast = rt.maxx;
+                for (int e = 0; e < 3; ++e) {
+                    vec2 l0 = rt.v[e];
+                    vec2 l1 = rt.v[(e + 1) % 3];
+                    int first, last;
+                    edgeSpan(l0, l1, y, rt.minx, rt.maxx, first, last);
+                    inFirst = std::max(inFirst, first);
+                    inLast = std::min(inLast, last);
+                    // the false range is the complement of [first, last]
+                    if (first <= last) {
+                        if (first > rt.minx)
+                            outLast = std::min(outLast, first - 1);
+                        else if (last < rt.maxx)
+                            outFirst = std::max(outFirst, last + 1);
+                        else
+                            outFirst = rt.maxx + 1;
+                    }
+                }
+
+                for (int x = inFirst; x <= inLast; ++x) {
+                    uint8_t& mk = mask(x, y);
+                    if (!(mk & MaskBit::Internal)) {
+                        mk |= MaskBit::Internal;
+                        count[band]++;
+                    }
+                }
+                for (int x = outFirst; x <= outLast; ++x) {
+                    uint8_t& mk = mask(x, y);
+                    if (!(mk & MaskBit::Internal)) {
+                        mk |= MaskBit::Internal;
+                        count[band]++;
+                    }
                 }
             }
         }
-    }
-    return n;
+    });
+
+    return std::accumulate(count.begin(), count.end(), 0u);
 }
 
 unsigned Image::setMaskSeam(const Mesh& m)
@@ -172,5 +437,5 @@ unsigned Image::setMaskSeam(const Mesh& m)
 void Image::clearMask()
 {
     mask_.clear();
-    mask_.resize(resx * resy, 0);
+    mask_.resize(numTexels(), 0);
 }
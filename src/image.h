@@ -1,6 +1,8 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <cstdint>
+#include <unordered_map>
 #include <vector>
 
 #include <glm/vec3.hpp>
@@ -11,16 +13,82 @@ using namespace glm;
 class Mesh;
 struct Pyramid;
 
+// x wrapped to [0, n), the divisions are only done for coordinates outside the range
+inline int wrapCoord(int x, int n)
+{
+    return (unsigned(x) < unsigned(n)) ? x : (x % n + n) % n;
+}
+
 class Image
 {
     friend struct Pyramid;
 
+public:
+
+    /* Float keeps the texels in data, Packed keeps them as 8 bit RGB triplets
+     * (in packed) and stores the texels whose value is not a vector of integers
+     * in [0, 255] in a float overlay. Writing such values to a Packed image is
+     * not thread safe, so code that writes texels from several threads (e.g.
+     * the decodeTo() methods) must work on Float images */
+    enum Storage {
+        Float,
+        Packed
+    };
+
+    /* RowMajor keeps the texels by row, Tiled keeps each 4x4 block of texels in
+     * 16 consecutive entries (by row) and the blocks by row within tiles of
+     * TILE_BLOCKS x TILE_BLOCKS blocks, themselves stored by row. Tiled images
+     * are allocated to a multiple of the tile size */
+    enum Layout {
+        RowMajor,
+        Tiled
+    };
+
+    static const int TILE_BLOCKS = 16;
+
+private:
+
+    Storage storage_;
+    Layout layout_;
+    int tilesX; // tiles per row of a Tiled image
+
     std::vector<vec3> data;
+    std::vector<uint8_t> packed;
+    std::vector<bool> modified; // texels of packed that are in the overlay
+    std::unordered_map<uint, vec3> overlay;
     //std::vector<float> mask;
     std::vector<uint8_t> mask_;
 
+    vec3 texel(uint i) const {
+        if (storage_ == Float)
+            return data[i];
+        if (modified[i])
+            return overlay.find(i)->second;
+        return vec3(packed[3 * i], packed[3 * i + 1], packed[3 * i + 2]);
+    }
+
+    void setTexel(uint i, const vec3& c);
+
+    // number of entries of the texel and mask arrays
+    size_t numTexels() const;
+
 public:
 
+    /* reference to a texel, returned by the non const pixel() */
+    class TexelRef {
+        Image& img;
+        uint i;
+
+    public:
+        TexelRef(Image& img, uint i) : img(img), i(i) {}
+
+        operator vec3() const { return img.texel(i); }
+        float operator[](int k) const { return img.texel(i)[k]; }
+
+        TexelRef& operator=(const vec3& c) { img.setTexel(i, c); return *this; }
+        TexelRef& operator=(const TexelRef& other) { img.setTexel(i, vec3(other)); return *this; }
+    };
+
     static constexpr double SEAM_SAMPLING_FACTOR = 2.0;
 
     enum MaskBit {
@@ -36,7 +104,22 @@ public:
     int resx;
     int resy;
 
-    Image() : resx(0), resy(0) {}
+    Image() : storage_(Float), layout_(RowMajor), tilesX(0), resx(0), resy(0) {}
+    explicit Image(Storage storage, Layout layout = RowMajor)
+        : storage_(storage), layout_(layout), tilesX(0), resx(0), resy(0) {}
+
+    Storage storage() const { return storage_; }
+    Layout layout() const { return layout_; }
+
+    // converts the texels to the given storage (Float to Packed keeps the
+    // values that are not 8 bit in the overlay)
+    void setStorage(Storage storage);
+
+    // rearranges the texels and the masks in the given layout
+    void setLayout(Layout layout);
+
+    // number of texels held in the float overlay of a Packed image
+    size_t overlaySize() const { return overlay.size(); }
 
 #ifdef __EMSCRIPTEN__
     void load(uint8_t *imgbuf, int w, int h);
@@ -49,21 +132,52 @@ public:
 
     void resize(int rx, int ry);
 
+    // halves the resolution of the image into out
+    void resampleHalf(Image& out, ResampleMode mode) const;
+
     void drawLine(vec2 from, vec2 to, vec3 c);
     void drawPoint(vec2 p, vec3 c);
 
-    uint indexOf(int x, int y) const;
+    // index of texel (x, y), the coordinates wrap around the borders
+    uint indexOf(int x, int y) const {
+        return indexOfInterior(wrapCoord(x, resx), wrapCoord(y, resy));
+    }
+
+    // index of texel (x, y), that must be inside the image
+    uint indexOfInterior(int x, int y) const {
+        if (layout_ == RowMajor)
+            return y * resx + x;
+        const int tileShift = 2 + 4; // log2(4 * TILE_BLOCKS)
+        uint tile = (y >> tileShift) * tilesX + (x >> tileShift);
+        uint block = (((y >> 2) & (TILE_BLOCKS - 1)) * TILE_BLOCKS) + ((x >> 2) & (TILE_BLOCKS - 1));
+        return (tile * TILE_BLOCKS * TILE_BLOCKS + block) * 16 + (y & 3) * 4 + (x & 3);
+    }
+
+    // unchecked accessors for texels inside the image
+    vec3 pixelInterior(int x, int y) const {
+        return texel(indexOfInterior(x, y));
+    }
+
+    uint8_t maskInterior(int x, int y) const {
+        return mask_[indexOfInterior(x, y)];
+    }
 
-    vec3& pixel(int x, int y) {
-        return data[indexOf(x, y)];
+    TexelRef pixel(int x, int y) {
+        return TexelRef(*this, indexOf(x, y));
     }
 
     vec3 pixel(int x, int y) const {
-        return data[indexOf(x, y)];
+        return texel(indexOf(x, y));
     }
 
     vec3 pixel(vec2 p) const;
 
+    /* bulk reads: the 16 texels (or masks) of block (bx, by) by row, and the
+     * resx texels of row y */
+    void readBlock(int bx, int by, vec3 *texels) const;
+    void readBlockMask(int bx, int by, uint8_t *masks) const;
+    void readRow(int y, vec3 *texels) const;
+
     uint8_t mask(int x, int y) const {
         return mask_[indexOf(x, y)];
     }
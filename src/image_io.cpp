@@ -31,9 +31,9 @@ bool Image::load(const char *path)
 
     resize(img.width(), img.height());
 
-    for (int y = 0, i = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x, ++i) {
-        data[i] = rgb2vec3(QColor(img.pixel(x, y)));
+    for (int y = 0; y < resy; ++y)
+    for (int x = 0; x < resx; ++x) {
+        pixel(x, y) = rgb2vec3(QColor(img.pixel(x, y)));
     }
 
     return true;
@@ -43,9 +43,9 @@ bool Image::save(const char *path) const
 {
     QImage img(resx, resy, QImage::Format_RGBA8888);
 
-    for (int y = 0, i = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x, ++i) {
-        img.setPixel(x, y, vec3toRgb(data[i]));
+    for (int y = 0; y < resy; ++y)
+    for (int x = 0; x < resx; ++x) {
+        img.setPixel(x, y, vec3toRgb(pixel(x, y)));
     }
 
     return img.save(path, "png", 66);
@@ -55,9 +55,9 @@ bool Image::saveMask(const char *path, uint8_t bits) const
 {
     QImage img(resx, resy, QImage::Format_RGBA8888);
 
-    for (int y = 0, i = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x, ++i) {
-        if (mask_[i] & bits)
+    for (int y = 0; y < resy; ++y)
+    for (int x = 0; x < resx; ++x) {
+        if (mask(x, y) & bits)
             img.setPixel(x, y, QColor(255, 255, 255).rgba());
         else
             img.setPixel(x, y, QColor(0, 0, 0).rgba());
@@ -68,11 +68,14 @@ bool Image::saveMask(const char *path, uint8_t bits) const
 
 bool CompressedImage::saveUncompressed(const char *path) const
 {
+    Image decoded;
+    decodeTo(decoded);
+
     QImage img(resx, resy, QImage::Format_RGBA8888);
 
     for (int y = 0; y < resy; ++y)
     for (int x = 0; x < resx; ++x) {
-        img.setPixel(x, y, vec3toRgb(pixel(x, y)));
+        img.setPixel(x, y, vec3toRgb(decoded.pixel(x, y)));
     }
 
     return img.save(path);
@@ -1,10 +1,9 @@
 #include "line.h"
 
+#include <cassert>
+#include <cmath>
 #include <vector>
 
-#include <Eigen/Core>
-#include <Eigen/Eigenvalues>
-
 #include <glm/common.hpp>
 #include <glm/geometric.hpp>
 
@@ -13,13 +12,74 @@ void Line3::normalize()
     d = glm::normalize(d);
 }
 
+static inline double norm2(const dvec3& v)
+{
+    return glm::dot(v, v);
+}
+
+// Eigenvector of the largest eigenvalue of the symmetric 3x3 matrix M (given by
+// rows). The eigenvalue is computed with the trigonometric solution of the
+// characteristic polynomial, the eigenvector as the largest cross product of the
+// rows of (M - lambda I)
+static dvec3 principalAxis(const dvec3 M[3])
+{
+    double p1 = M[0].y * M[0].y + M[0].z * M[0].z + M[1].z * M[1].z;
+    double q = (M[0].x + M[1].y + M[2].z) / 3.0;
+    double p2 = (M[0].x - q) * (M[0].x - q) + (M[1].y - q) * (M[1].y - q) + (M[2].z - q) * (M[2].z - q) + 2.0 * p1;
+
+    if (!(p2 > 0))
+        return dvec3(1, 0, 0); // isotropic, any direction is a principal axis
+
+    double p = std::sqrt(p2 / 6.0);
+    dvec3 B[3] = {
+        (M[0] - dvec3(q, 0, 0)) / p,
+        (M[1] - dvec3(0, q, 0)) / p,
+        (M[2] - dvec3(0, 0, q)) / p
+    };
+    double r = 0.5 * (B[0].x * (B[1].y * B[2].z - B[1].z * B[2].y)
+                    - B[0].y * (B[1].x * B[2].z - B[1].z * B[2].x)
+                    + B[0].z * (B[1].x * B[2].y - B[1].y * B[2].x));
+    r = glm::clamp(r, -1.0, 1.0);
+    double lambda = q + 2.0 * p * std::cos(std::acos(r) / 3.0);
+
+    dvec3 R[3] = {
+        M[0] - dvec3(lambda, 0, 0),
+        M[1] - dvec3(0, lambda, 0),
+        M[2] - dvec3(0, 0, lambda)
+    };
+
+    dvec3 c[3] = { glm::cross(R[0], R[1]), glm::cross(R[0], R[2]), glm::cross(R[1], R[2]) };
+    int k = 0;
+    for (int i = 1; i < 3; ++i)
+        if (norm2(c[i]) > norm2(c[k]))
+            k = i;
+
+    if (norm2(c[k]) > 1e-20 * p2 * p2)
+        return c[k] / std::sqrt(norm2(c[k]));
+
+    // the largest eigenvalue is repeated and (M - lambda I) has rank one, any
+    // direction orthogonal to its non-null row is a principal axis
+    k = 0;
+    for (int i = 1; i < 3; ++i)
+        if (norm2(R[i]) > norm2(R[k]))
+            k = i;
+    dvec3 a = std::abs(R[k].x) < std::abs(R[k].y) ? dvec3(1, 0, 0) : dvec3(0, 1, 0);
+    dvec3 v = glm::cross(R[k], a);
+    return v / std::sqrt(norm2(v));
+}
+
 Line3 fitLine(const std::vector<vec3>& points)
 {
-    assert(points.size() > 0);
+    return fitLine(points.data(), points.size());
+}
+
+Line3 fitLine(const vec3 *points, unsigned n)
+{
+    assert(n > 0);
 
-    if (points.size() == 1) {
+    if (n == 1) {
         return Line3(vec3(points[0].x, points[0].y, points[0].z), vec3(1, 0, 0));
-    } else if (points.size() == 2) {
+    } else if (n == 2) {
         float d = glm::distance(points[1], points[0]);
         if (d > 0)
             return Line3(glm::mix(points[0], points[1], 0.5), glm::normalize(points[1] - points[0]));
@@ -27,29 +87,25 @@ Line3 fitLine(const std::vector<vec3>& points)
             return Line3(vec3(points[0].x, points[0].y, points[0].z), vec3(1, 0, 0));
     }
 
-    assert(points.size() > 2);
-
-    Eigen::MatrixXd X(points.size(), 3);
-    for (unsigned i = 0; i < points.size(); ++i)
-        X.row(i) = Eigen::Vector3d(points[i].x, points[i].y, points[i].z);
+    assert(n > 2);
 
+    dvec3 c(0);
+    for (unsigned i = 0; i < n; ++i)
+        c += dvec3(points[i]);
+    c /= double(n);
 
-    Eigen::Vector3d c = X.colwise().mean();
-    X.rowwise() -= c.transpose();
-
-    Eigen::Matrix3d M = X.transpose() * X;
+    dvec3 M[3] = { dvec3(0), dvec3(0), dvec3(0) };
+    for (unsigned i = 0; i < n; ++i) {
+        dvec3 x = dvec3(points[i]) - c;
+        M[0] += x.x * x;
+        M[1] += x.y * x;
+        M[2] += x.z * x;
+    }
 
     // compute principal component
-    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> es;
-    es.compute(M);
-    assert(es.info() == Eigen::Success);
-
-    int k;
-    es.eigenvalues().maxCoeff(&k);
-    Eigen::VectorXd p = es.eigenvalues();
-    Eigen::VectorXd pc = es.eigenvectors().col(k);
+    dvec3 pc = principalAxis(M);
 
-    Line3 l(vec3(c.x(), c.y(), c.z()), vec3(pc.x(), pc.y(), pc.z()));
+    Line3 l(vec3(c.x, c.y, c.z), vec3(pc.x, pc.y, pc.z));
 
     assert(std::isfinite(l.o.x));
     assert(std::isfinite(l.o.y));
@@ -39,4 +39,9 @@ struct Line3
 /* Returns the normalized best fitting line (computed using PCA) */
 Line3 fitLine(const std::vector<vec3>& points);
 
+/* Same as above, specialized for the small point sets of the block encoder. The
+ * 3x3 covariance is accumulated on the stack and its principal axis is found in
+ * closed form, so the function does not allocate */
+Line3 fitLine(const vec3 *points, unsigned n);
+
 #endif // LINE_H
@@ -4,18 +4,28 @@
 #include "mesh.h"
 #include "solver.h"
 #include "compressed_image.h"
+#include "channel_image.h"
 #include "pyramid.h"
 #include "metric.h"
+#include "active_set.h"
+#include "thread_pool.h"
+#include "block_cache.h"
+#include "virtual_texture.h"
 
+#include <fstream>
+#include <iterator>
 #include <set>
+#include <map>
+#include <string>
 #include <algorithm>
 #include <chrono>
+#include <cctype>
+#include <cstdlib>
 
-CompressedImage compressAndOptimzeTexture(Mesh& m, const Image& texture, int maxIter)
+// cimg must already hold an encoding of texture (its configuration is kept)
+CompressedImage compressAndOptimzeTexture(Mesh& m, const Image& texture, const ActiveSet& active, int maxIter,
+                                          CompressedImage cimg)
 {
-    CompressedImage cimg;
-
-    cimg.initialize(texture, Image::MaskBit::Seam | Image::MaskBit::Internal);
     cimg.quantizeBlocks();
 
     std::set<int> fixedBlocks;
@@ -29,7 +39,7 @@ CompressedImage compressAndOptimzeTexture(Mesh& m, const Image& texture, int max
         if (n >= maxIter)
             break;
 
-        std::vector<BlockErrorData> err = cimg.computePerBlockError(texture);
+        std::vector<BlockErrorData> err = cimg.computePerBlockError(texture, active);
 
         std::sort(err.begin(), err.end(), [](const BlockErrorData& e1, const BlockErrorData& e2) { return e1.avgError < e2.avgError; });
 
@@ -51,15 +61,83 @@ CompressedImage compressAndOptimzeTexture(Mesh& m, const Image& texture, int max
     return cimg;
 }
 
-static void parseArgs(int argc, char *argv[], std::vector<std::string>& positionalArgs, std::set<char>& options)
+// replicates the last column and row of img up to a multiple of 4 texels (the
+// masks of the added texels are cleared)
+static Image padToBlocks(const Image& img)
+{
+    Image padded;
+    padded.resize((img.resx + 3) & ~3, (img.resy + 3) & ~3);
+    for (int y = 0; y < padded.resy; ++y)
+    for (int x = 0; x < padded.resx; ++x) {
+        padded.pixel(x, y) = img.pixel(std::min(x, img.resx - 1), std::min(y, img.resy - 1));
+        if (x < img.resx && y < img.resy)
+            padded.mask(x, y) = img.mask(x, y);
+    }
+    return padded;
+}
+
+// the mip levels below texture, down to 1x1. Each level is downsampled from the
+// seamless level above and made seamless again, with its own masks
+static std::vector<Image> seamlessMipChain(const Mesh& m, const Image& texture)
+{
+    std::vector<Image> mips;
+    while (true) {
+        const Image& prev = mips.empty() ? texture : mips.back();
+        if (prev.resx == 1 && prev.resy == 1)
+            break;
+        Image level;
+        prev.resampleHalf(level, Image::ResampleMode::Linear);
+        level.setMaskInternal(m);
+        level.setMaskSeam(m);
+        if (level.resx >= 4 && level.resy >= 4)
+            Solver().fixSeams(m, level);
+        mips.push_back(level);
+    }
+    return mips;
+}
+
+// compresses the levels one after the other (each level uses the thread pool),
+// the seam-aware endpoint optimization is skipped on the levels whose size is
+// not a multiple of the block size
+static std::vector<CompressedImage> compressMipChain(Mesh& m, const std::vector<Image>& mips, const CompressedImage& encoder)
+{
+    std::vector<CompressedImage> cmips;
+    for (unsigned i = 0; i < mips.size(); ++i) {
+        Image level = padToBlocks(mips[i]);
+
+        // same configuration as encoder, but its own block cache
+        CompressedImage cimg(encoder.layout());
+        cimg.setPreset(encoder.preset());
+        cimg.setBlockCache(encoder.blockCache() != nullptr);
+
+        cimg.initialize(level, Image::MaskBit::Seam | Image::MaskBit::Internal);
+        if (level.resx == mips[i].resx && level.resy == mips[i].resy) {
+            ActiveSet active(level, Image::MaskBit::Internal | Image::MaskBit::Seam);
+            cmips.push_back(compressAndOptimzeTexture(m, level, active, 1, cimg));
+        } else {
+            cimg.quantizeBlocks();
+            cmips.push_back(cimg);
+        }
+    }
+    return cmips;
+}
+
+/* Options are single characters, optionally followed by a value (e.g. -j4) */
+static void parseArgs(int argc, char *argv[], std::vector<std::string>& positionalArgs, std::set<char>& options,
+                      std::map<char, std::string>& optionValues)
 {
     positionalArgs.clear();
     options.clear();
+    optionValues.clear();
     for (int i = 1; i < argc; ++i) {
         std::string arg(argv[i]);
         if (arg[0] == '-' && arg.size() == 2) {
             options.insert(arg[1]);
             std::cout << "Found option: " << arg[1] << std::endl;
+        } else if (arg[0] == '-' && arg.size() > 2 && std::isalpha(arg[1])) {
+            options.insert(arg[1]);
+            optionValues[arg[1]] = arg.substr(2);
+            std::cout << "Found option: " << arg[1] << " = " << optionValues[arg[1]] << std::endl;
         } else if (arg[0] != '-') {
             positionalArgs.push_back(arg);
             std::cout << "Found positional argument: " << positionalArgs.back() << std::endl;
@@ -73,14 +151,37 @@ int main(int argc, char *argv[])
 {
     std::vector<std::string> positionalArgs;
     std::set<char> options;
+    std::map<char, std::string> optionValues;
 
-    parseArgs(argc, argv, positionalArgs, options);
+    parseArgs(argc, argv, positionalArgs, options, optionValues);
 
     if (positionalArgs.size() < 2) {
-        std::cerr << "Usage: " << argv[0] << " obj texture [-c]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " obj texture|texture.dds [-c] [-m] [-s] [-vN] [-b4|-b5] [-p|-a] [-d] [-e] [-jN] [-qfast|-qdefault|-qiterative|-qexhaustive]" << std::endl;
         std::exit(-1);
     }
 
+    // -jN uses N threads, -j (or -j0) one per hardware thread
+    if (optionValues.count('j'))
+        ThreadPool::instance().setNumThreads(std::atoi(optionValues['j'].c_str()));
+    std::cout << "Using " << ThreadPool::instance().numThreads() << " threads" << std::endl;
+
+    // -p keeps the compressed blocks packed in memory, -a in arrays of endpoint channels
+    CompressedImage::Layout layout = CompressedImage::Float;
+    if (options.count('p'))
+        layout = CompressedImage::Packed;
+    else if (options.count('a'))
+        layout = CompressedImage::SoA;
+
+    CompressedImage::Preset preset = CompressedImage::Default;
+    if (optionValues.count('q') && !CompressedImage::presetFromName(optionValues['q'].c_str(), preset))
+        std::cerr << "Warning: unknown encoder preset " << optionValues['q'] << ", using default" << std::endl;
+
+    CompressedImage encoder(layout);
+    encoder.setPreset(preset);
+
+    // -d encodes repeated blocks only once
+    encoder.setBlockCache(options.count('d') > 0);
+
     auto n1 = positionalArgs[0].find_last_of('/');
     if (n1 == std::string::npos)
         n1 = 0;
@@ -99,8 +200,44 @@ int main(int argc, char *argv[])
 
     m.mirrorV();
 
+    // -- compressed input: seam repair on the endpoints only ------------------
+
+    std::string texturePath = positionalArgs[1];
+    if (texturePath.size() > 4 && texturePath.compare(texturePath.size() - 4, 4, ".dds") == 0) {
+        std::cout << "Loading compressed texture..." << std::endl;
+        CompressedImage cimg = encoder;
+        if (!cimg.load(texturePath.c_str())) {
+            std::cerr << "Error reading dds file " << texturePath << " (only DXT1 is supported)" << std::endl;
+            std::exit(-1);
+        }
+
+        std::cout << "Computing pixel masks..." << std::endl;
+        Image masks;
+        masks.resize(cimg.resx, cimg.resy);
+        unsigned ni = masks.setMaskInternal(m);
+        unsigned ns = masks.setMaskSeam(m);
+        std::cout << ni << " internal pixels, " << ns << " seam pixels" << std::endl;
+
+        // blocks whose palette could not be represented exactly are kept as they are
+        std::set<int> fixedBlocks(cimg.approximatedBlocks().begin(), cimg.approximatedBlocks().end());
+
+        std::cout << "Solving seam-aware endpoints..." << std::endl;
+        SolverCompressedImage().fixSeamsEndpoints(m, masks, cimg, fixedBlocks);
+        cimg.quantizeBlocks();
+
+        std::string textureOutName = meshName + "_scf.png";
+        std::string textureOutNameDDs = meshName + "_scf.dds";
+        std::string meshOutName = meshName + "_scf";
+        cimg.saveUncompressed(textureOutName.c_str());
+        if (!cimg.save(textureOutNameDDs.c_str()))
+            std::cerr << "Error writing dds file " << textureOutNameDDs << std::endl;
+        m.saveObjFile(meshOutName.c_str(), textureOutName.c_str(), true);
+        return 0;
+    }
+
     std::cout << "Loading texture..." << std::endl;
-    Image img;
+    // the texture is 8 bit, only the texels modified by the solver need floats
+    Image img(Image::Packed);
     img.load(positionalArgs[1].c_str());
 
     std::cout << "Computing pixel masks..." << std::endl;
@@ -110,16 +247,34 @@ int main(int argc, char *argv[])
 
     std::cout << ni << " internal pixels, " << ns << " seam pixels" << std::endl;
 
+    ActiveSet active(img, Image::MaskBit::Internal | Image::MaskBit::Seam);
+
+    std::cout << "Compressing texture..." << std::endl;
+    CompressedImage original = encoder;
+    original.initialize(img, Image::MaskBit::Internal | Image::MaskBit::Seam);
+
     // -- seamless -------------------------------------------------------------
 
     Image img_seamless = img;
+    CompressedImage encoded = original;
+    uint64_t cacheHits = 0;
+    uint64_t cacheLookups = 0; // block cache use of the encodings above
     {
         std::cout << "Solving seamless..." << std::endl;
         auto t0 = std::chrono::high_resolution_clock::now();
-        Solver().fixSeams(m, img_seamless);
+        Solver solver;
+        solver.fixSeams(m, img_seamless);
         auto t1 = std::chrono::high_resolution_clock::now();
         std::cout << "Optimization took " << std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count() << " ms" << std::endl;
 
+        // only the blocks touched by the solver need to be encoded again
+        encoded.update(img_seamless, Image::MaskBit::Internal | Image::MaskBit::Seam, solver.modifiedTexels());
+        std::cout << "Re-encoded " << solver.modifiedTexels().nblk() << " of " << encoded.nblk() << " blocks" << std::endl;
+        if (encoded.blockCache()) {
+            cacheHits = encoded.blockCache()->numHits();
+            cacheLookups = encoded.blockCache()->numLookups();
+        }
+
         std::string textureOutName = meshName + "_s.png";
         std::string meshOutName = meshName + "_s";
         img_seamless.save(textureOutName.c_str());
@@ -135,29 +290,107 @@ int main(int argc, char *argv[])
     // -- seamless seam-aware compression 1 iteration ----------------------
     {
         std::cout << "Solving seamless seam-aware compression 1 iteration..." << std::endl;
-        CompressedImage cimg = compressAndOptimzeTexture(m, img_seamless, 1);
+        CompressedImage cimg = compressAndOptimzeTexture(m, img_seamless, active, 1, encoded);
         std::string textureOutName = meshName + "_sc_seamless.png";
         std::string textureOutNameDDs = meshName + "_sc_seamless.dds";
         std::string meshOutName = meshName + "_sc_seamless";
         cimg.saveUncompressed(textureOutName.c_str());
-        cimg.save(textureOutNameDDs.c_str());
+
+        // -m writes the whole mip chain, with each level made seamless
+        std::vector<const CompressedImage *> levels(1, &cimg);
+        std::vector<CompressedImage> cmips;
+        if (options.count('m')) {
+            std::cout << "Building seam-aware mip chain..." << std::endl;
+            cmips = compressMipChain(m, seamlessMipChain(m, img_seamless), encoder);
+            for (const CompressedImage& level : cmips)
+                levels.push_back(&level);
+        }
+        if (!CompressedImage::save(textureOutNameDDs.c_str(), levels))
+            std::cerr << "Error writing dds file " << textureOutNameDDs << std::endl;
+
+        // -s also writes the blocks that contain internal or seam texels in the sparse format
+        if (options.count('s')) {
+            std::string sparseOutName = meshName + "_sc_seamless.sbc";
+            size_t sparseSize = cimg.sparseSize(active);
+            std::cout << "Sparse output " << sparseSize << " bytes, " << active.nblk() << " of " << cimg.nblk()
+                      << " blocks (" << cimg.ddsSize() - sparseSize << " bytes saved)" << std::endl;
+            if (!cimg.saveSparse(sparseOutName.c_str(), active))
+                std::cerr << "Error writing sparse file " << sparseOutName << std::endl;
+        }
+
+        // -vN cuts the blocks in virtual texture pages of N texels (128 by
+        // default) with a 4 texel border
+        if (options.count('v')) {
+            int pageSize = optionValues.count('v') ? std::atoi(optionValues['v'].c_str()) : 128;
+            VirtualTexture vt;
+            std::string pagesOutName = meshName + "_sc_seamless.pages";
+            if (!vt.setup(cimg.resx, cimg.resy, pageSize, 4))
+                std::cerr << "Error: page size " << pageSize << " must be a multiple of 4 that divides the texture size" << std::endl;
+            else if (!vt.save(pagesOutName.c_str(), cimg, img, Image::MaskBit::Internal | Image::MaskBit::Seam))
+                std::cerr << "Error writing page file " << pagesOutName << std::endl;
+        }
         m.saveObjFile(meshOutName.c_str(), textureOutName.c_str(), true);
     }
 
     // -- seamless compressed ----------------------------------------------
     {
         std::cout << "Compressing seamless texture with PCA..." << std::endl;
-        CompressedImage cimg;
-        cimg.initialize(img_seamless, Image::MaskBit::Internal | Image::MaskBit::Seam);
+        CompressedImage cimg = encoded;
         cimg.quantizeBlocks();
+        if (cimg.blockCache())
+            std::cout << "Block cache hit rate " << (cacheLookups > 0 ? 100.0 * cacheHits / cacheLookups : 0.0) << "% ("
+                      << cacheHits << " of " << cacheLookups << " blocks)" << std::endl;
 
         std::string textureOutName = meshName + "_sc.png";
         std::string textureOutNameDDs = meshName + "_sc.dds";
         std::string meshOutName = meshName + "_sc";
         cimg.saveUncompressed(textureOutName.c_str());
-        cimg.save((textureOutNameDDs.c_str()));
+        if (!cimg.save(textureOutNameDDs.c_str()))
+            std::cerr << "Error writing dds file " << textureOutNameDDs << std::endl;
         m.saveObjFile(meshOutName.c_str(), textureOutName.c_str(), true);
 
+        // -e also streams the seamless texture with encodeToFile() and checks
+        // the file against a full encoding
+        if (options.count('e')) {
+            std::string streamOutName = meshName + "_sc_stream.dds";
+            CompressedImage reference(encoder.layout());
+            reference.setPreset(encoder.preset());
+            reference.initialize(img_seamless, Image::MaskBit::Internal | Image::MaskBit::Seam);
+            reference.quantizeBlocks();
+
+            if (!encoder.encodeToFile(img_seamless, Image::MaskBit::Internal | Image::MaskBit::Seam, streamOutName.c_str())) {
+                std::cerr << "Error writing dds file " << streamOutName << std::endl;
+            } else {
+                std::ifstream in(streamOutName, std::ios::binary);
+                std::vector<uint8_t> streamed((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+                if (streamed == reference.toDDS())
+                    std::cout << "Streamed output matches the full encoding (" << streamed.size() << " bytes)" << std::endl;
+                else
+                    std::cerr << "Error: streamed output " << streamOutName << " differs from the full encoding" << std::endl;
+            }
+        }
+    }
+
+    // -- seamless seam-aware single and two channel compression -------------
+
+    // -b4 writes the red channel of the seamless texture as BC4, -b5 the red and
+    // green channels as BC5
+    if (optionValues.count('b')) {
+        std::string fmt = optionValues['b'];
+        if (fmt != "4" && fmt != "5") {
+            std::cerr << "Warning: unknown block format bc" << fmt << std::endl;
+        } else {
+            std::cout << "Solving seamless seam-aware BC" << fmt << " compression..." << std::endl;
+            ChannelCompressedImage cimg(fmt == "4" ? ChannelCompressedImage::BC4 : ChannelCompressedImage::BC5);
+            cimg.initialize(img_seamless, Image::MaskBit::Internal | Image::MaskBit::Seam);
+            cimg.quantizeBlocks();
+            SolverChannelImage().fixSeams(m, img_seamless, cimg);
+            cimg.quantizeBlocks();
+
+            std::string textureOutNameDDs = meshName + "_sc_seamless_bc" + fmt + ".dds";
+            if (!cimg.save(textureOutNameDDs.c_str()))
+                std::cerr << "Error writing dds file " << textureOutNameDDs << std::endl;
+        }
     }
 
     return 0;
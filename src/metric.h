@@ -2,11 +2,35 @@
 #define METRIC_H
 
 #include "image.h"
+#include "active_set.h"
+#include "compressed_image.h"
 #include <glm/geometric.hpp>
 
+template <typename ImgCmpType2>
+double mse(const Image& i1, const ImgCmpType2& i2, const ActiveSet& active)
+{
+    assert(i1.resx == i2.resx);
+    assert(i1.resy == i2.resy);
+    assert(i1.resx == active.resx);
+    assert(i1.resy == active.resy);
+
+    double sum = 0;
+    int count = 0;
+    active.forEachTexel([&](int x, int y) {
+        vec3 d = i1.pixelInterior(x, y) - i2.pixel(x, y);
+        sum += glm::dot(d, d);
+        count += 3;
+    });
+
+    return sum / (double) count;
+}
+
 template <typename ImgCmpType2>
 double mse(const Image& i1, const ImgCmpType2& i2, uint8_t bitmask = 0)
 {
+    if (bitmask)
+        return mse(i1, i2, ActiveSet(i1, bitmask));
+
     assert(i1.resx == i2.resx);
     assert(i1.resy == i2.resy);
 
@@ -14,15 +38,47 @@ double mse(const Image& i1, const ImgCmpType2& i2, uint8_t bitmask = 0)
     int count = 0;
     for (int y = 0; y < i1.resy; ++y) {
         for (int x = 0; x < i1.resx; ++x) {
-            if ((!bitmask) || (i1.mask(x, y) & bitmask)) {
-                vec3 d = i1.pixel(x, y) - i2.pixel(x,y);
-                sum += glm::dot(d, d);
-                count += 3;
-            }
+            vec3 d = i1.pixelInterior(x, y) - i2.pixel(x,y);
+            sum += glm::dot(d, d);
+            count += 3;
         }
     }
 
     return sum / (double) count;
 }
 
+// compressed images are decoded a block at a time
+
+inline double mse(const Image& i1, const CompressedImage& i2, const ActiveSet& active)
+{
+    assert(i1.resx == i2.resx);
+    assert(i1.resy == i2.resy);
+    assert(i1.resx == active.resx);
+    assert(i1.resy == active.resy);
+
+    double sum = 0;
+    int count = 0;
+    vec3 texels[16];
+    for (const ActiveBlock& b : active.block) {
+        i2.decodeBlock(b.index, texels);
+        active.forEachTexel(b, [&](int x, int y) {
+            vec3 d = i1.pixelInterior(x, y) - texels[(y % 4) * 4 + (x % 4)];
+            sum += glm::dot(d, d);
+            count += 3;
+        });
+    }
+
+    return sum / (double) count;
+}
+
+inline double mse(const Image& i1, const CompressedImage& i2, uint8_t bitmask = 0)
+{
+    if (bitmask)
+        return mse(i1, i2, ActiveSet(i1, bitmask));
+
+    Image decoded;
+    i2.decodeTo(decoded);
+    return mse(i1, decoded);
+}
+
 #endif // METRIC_H
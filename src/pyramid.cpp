@@ -22,20 +22,16 @@ void Pyramid::init(const Image& img)
 void Pyramid::pullNearest()
 {
     while (level.back().resx > 1 && level.back().resy > 1) {
-        Image& imgprev = level.back();
         level.push_back(Image());
-        assert(0);
-        //imgprev.resampleHalf(level.back(), Image::ResampleMode::Nearest);
+        level[level.size() - 2].resampleHalf(level.back(), Image::ResampleMode::Nearest);
     }
 }
 
 void Pyramid::pullLinear()
 {
     while (level.back().resx > 1 && level.back().resy > 1) {
-        Image& imgprev = level.back();
         level.push_back(Image());
-        assert(0);
-        //imgprev.resampleHalf(level.back(), Image::ResampleMode::Linear);
+        level[level.size() - 2].resampleHalf(level.back(), Image::ResampleMode::Linear);
     }
 }
 
@@ -2,7 +2,10 @@
 
 #include "solver.h"
 #include "image.h"
+#include "thread_pool.h"
 
+#include <algorithm>
+#include <limits>
 #include <memory>
 
 Solver::Solver()
@@ -17,6 +20,7 @@ void Solver::fixSeams(const Mesh& m, Image& img)
 
     vi.clear();
     vi.resize(resx * resy, -1);
+    activeSet.clear(resx, resy);
 
     sys.clear();
 
@@ -29,6 +33,7 @@ void Solver::fixSeams(const Mesh& m, Image& img)
             );
         }
     }
+    activeSet.finalize();
 
     LinearEquationSet s1 = sys;
     sys.printShort();
@@ -37,19 +42,13 @@ void Solver::fixSeams(const Mesh& m, Image& img)
     //std::vector<scalar> init(vi.size() * 3, 0);
 
     // be yourself
-    for (int y = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x) {
-        if (vi[indexOf(x, y)] != -1) {
-            double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1.0 : 0.1;
-            //double w = 0.01;
-            sys.addEquation(w * (
-                pixel(x, y) == img.pixel(x, y)
-            ));
-            //init[vi[indexOf(x, y)] + 0] = img.pixel(x, y).r;
-            //init[vi[indexOf(x, y)] + 1] = img.pixel(x, y).g;
-            //init[vi[indexOf(x, y)] + 2] = img.pixel(x, y).b;
-        }
-    }
+    activeSet.forEachTexel([&](int x, int y) {
+        double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1.0 : 0.1;
+        //double w = 0.01;
+        sys.addEquation(w * (
+            pixel(x, y) == img.pixel(x, y)
+        ));
+    });
 
     sys.printShort();
     std::vector<scalar> vars;
@@ -73,12 +72,9 @@ void Solver::fixSeams(const Mesh& m, Image& img)
 
     assert(std::abs(e1_tot - (e1_seamless + e1_id)) < 0.001);
 
-    for (int y = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x) {
-        if (vi[indexOf(x, y)] != -1) {
-            img.pixel(x, y) = glm::clamp(pixel(x, y).evaluateFor(vars), vec3(0), vec3(255));
-        }
-    }
+    activeSet.forEachTexel([&](int x, int y) {
+        img.pixel(x, y) = glm::clamp(pixel(x, y).evaluateFor(vars), vec3(0), vec3(255));
+    });
 }
 
 void Solver::fixSeamsMIP(const Mesh& m, Image& img, const Image& img0, const std::vector<int>& cover0)
@@ -88,6 +84,7 @@ void Solver::fixSeamsMIP(const Mesh& m, Image& img, const Image& img0, const std
 
     vi.clear();
     vi.resize(resx * resy, -1);
+    activeSet.clear(resx, resy);
 
     sys.clear();
 
@@ -164,12 +161,10 @@ void Solver::fixSeamsMIP(const Mesh& m, Image& img, const Image& img0, const std
 
     std::cout << "error " << e1 << " -> " << e2 << std::endl;
 
-    for (int y = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x) {
-        if (vi[indexOf(x, y)] != -1) {
-            img.pixel(x, y) = pixel(x, y).evaluateFor(vars);
-        }
-    }
+    activeSet.finalize();
+    activeSet.forEachTexel([&](int x, int y) {
+        img.pixel(x, y) = pixel(x, y).evaluateFor(vars);
+    });
 }
 
 bool Solver::active(const ivec2& p) const
@@ -181,15 +176,19 @@ bool Solver::active(const ivec2& p) const
 
 int Solver::indexOf(int x, int y) const
 {
-    x = (x + resx) % resx;
-    y = (y + resy) % resy;
-    return y * resx + x;
+    return wrapCoord(y, resy) * resx + wrapCoord(x, resx);
 }
 
 LinearVec3 Solver::pixel(int x, int y)
 {
-    int i = indexOf(x, y);
+    return pixelAt(indexOf(x, y), x, y);
+}
+
+// the variables of texel (x, y), whose index is i
+LinearVec3 Solver::pixelAt(int i, int x, int y)
+{
     if (vi[i] == -1) {
+        activeSet.insert(x, y);
         vi[i] = sys.nvar;
         return sys.newLinearVec3();
     } else {
@@ -203,13 +202,73 @@ LinearVec3 Solver::pixel(vec2 p)
     vec2 p0 = floor(p);
     vec2 p1 = floor(p + vec2(1));
     vec2 w = fract(p);
+
+    int x0 = int(p0.x);
+    int y0 = int(p0.y);
+    int x1 = int(p1.x);
+    int y1 = int(p1.y);
+    if (x0 >= 0 && y0 >= 0 && x1 < resx && y1 < resy) {
+        int i00 = y0 * resx + x0;
+        int i01 = y1 * resx + x0;
+        return mix(
+            mix(pixelAt(i00, x0, y0), pixelAt(i00 + (x1 - x0), x1, y0), scalar(w.x)),
+            mix(pixelAt(i01, x0, y1), pixelAt(i01 + (x1 - x0), x1, y1), scalar(w.x)),
+            scalar(w.y)
+        );
+    }
+
     return mix(
-        mix(pixel(int(p0.x), int(p0.y)), pixel(int(p1.x), int(p0.y)), scalar(w.x)),
-        mix(pixel(int(p0.x), int(p1.y)), pixel(int(p1.x), int(p1.y)), scalar(w.x)),
+        mix(pixel(x0, y0), pixel(x1, y0), scalar(w.x)),
+        mix(pixel(x0, y1), pixel(x1, y1), scalar(w.x)),
         scalar(w.y)
     );
 }
 
+/* Linear combination of block endpoints. The three channels of an endpoint have
+ * the same weight, so only the index of the first variable is stored. Weights
+ * are accumulated in the same order as the LinearVec3 operators would */
+struct SolverCompressedImage::Stencil {
+    static const int MAX_TERMS = 16;
+
+    int n;
+    int var[MAX_TERMS];
+    scalar w[MAX_TERMS];
+
+    Stencil() : n{0} {}
+
+    void add(int v, scalar k) {
+        for (int i = 0; i < n; ++i) {
+            if (var[i] == v) {
+                w[i] += k;
+                return;
+            }
+        }
+        assert(n < MAX_TERMS);
+        var[n] = v;
+        w[n++] = k;
+    }
+
+    void scale(scalar k) {
+        for (int i = 0; i < n; ++i)
+            w[i] *= k;
+    }
+
+    void add(const Stencil& other, scalar k) {
+        for (int i = 0; i < other.n; ++i)
+            add(other.var[i], other.w[i] * k);
+    }
+
+    LinearVec3 toLinearVec3() const {
+        LinearVec3 res;
+        for (int i = 0; i < n; ++i) {
+            res.x.terms[var[i] + 0] = w[i];
+            res.y.terms[var[i] + 1] = w[i];
+            res.z.terms[var[i] + 2] = w[i];
+        }
+        return res;
+    }
+};
+
 SolverCompressedImage::SolverCompressedImage()
     : cptr{nullptr}
 {
@@ -217,6 +276,16 @@ SolverCompressedImage::SolverCompressedImage()
 }
 
 void SolverCompressedImage::fixSeams(const Mesh& m, const Image& img, CompressedImage& cimg, const std::set<int>& fixedBlocks)
+{
+    solve(m, img, cimg, fixedBlocks, false);
+}
+
+void SolverCompressedImage::fixSeamsEndpoints(const Mesh& m, const Image& masks, CompressedImage& cimg, const std::set<int>& fixedBlocks)
+{
+    solve(m, masks, cimg, fixedBlocks, true);
+}
+
+void SolverCompressedImage::solve(const Mesh& m, const Image& img, CompressedImage& cimg, const std::set<int>& fixedBlocks, bool keepBlockColors)
 {
     resx = img.resx;
     resy = img.resy;
@@ -225,34 +294,50 @@ void SolverCompressedImage::fixSeams(const Mesh& m, const Image& img, Compressed
 
     vi.clear();
     vi.resize(cimg.nblk() * 2, -1);
+    activeSet.clear(resx, resy);
 
     sys.clear();
 
     cptr = &cimg;
 
+    indices.resize(cimg.nblk());
+    for (unsigned i = 0; i < indices.size(); ++i)
+        indices[i] = cimg.getIndices(i);
+
     // be seamless
     for (const Seam& s : m.seam) {
         double d = m.maxLength(s, vec2(resx, resy));
         for (double t = 0; t <= 1; t += 1 / (2*d)) {
-            sys.addEquation(
-                pixel(m.uvpos(s.first, t) * vec2(resx, resy)) == pixel(m.uvpos(s.second, t) * vec2(resx, resy))
-            );
+            // the stencils are built right to left so that the variables are
+            // numbered as when the equation was written with the operators
+            Stencil st1, st2;
+            addBilinear(m.uvpos(s.second, t) * vec2(resx, resy), 1, st2);
+            addBilinear(m.uvpos(s.first, t) * vec2(resx, resy), 1, st1);
+            st1.add(st2, -1);
+            sys.addEquation(st1.toLinearVec3());
         }
     }
+    activeSet.finalize();
     sys.printShort();
 
     LinearEquationSet s1 = sys;
 
-    // be yourself
-    for (int y = 0; y < resy; ++y)
-    for (int x = 0; x < resx; ++x) {
-        int bx = x / 4;
-        int by = y / 4;
-        if ((vi[indexOf(bx, by, 0)] != -1) || (vi[indexOf(bx, by, 1)] != -1)) {
-            double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1 : 0.1;
-            sys.addEquation(w * (
-                pixel(x, y) == img.pixel(x, y)
-            ));
+    // be yourself (only the texels of blocks touched by the seam constraints)
+    activeSet.forEachTexel([&](int x, int y) {
+        double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1 : 0.1;
+        sys.addEquation(w * (
+            pixel(x, y) == (keepBlockColors ? cimg.pixel(x, y) : img.pixel(x, y))
+        ));
+    });
+
+    // weakly keep the endpoints where they are, so that endpoints that are only
+    // used through one interpolated palette entry (e.g. single color blocks)
+    // remain determined
+    for (const ActiveBlock& b : activeSet.block) {
+        for (int ci = 0; ci < 2; ++ci) {
+            int v = vi[2 * b.index + ci];
+            if (v != -1)
+                sys.addEquation(0.01 * (LinearVec3(v, v + 1, v + 2) == cimg.getEndpoint(b.index, ci)));
         }
     }
     sys.printShort();
@@ -273,13 +358,13 @@ void SolverCompressedImage::fixSeams(const Mesh& m, const Image& img, Compressed
 
         if (v0 != -1) {
             LinearVec3 c0 = LinearVec3(v0, v0 + 1, v0 + 2);
-            sys.addEquation(10000 * (c0 == cimg.getBlock(i).c0));
+            sys.addEquation(10000 * (c0 == cimg.getEndpoint(i, 0)));
             k++;
         }
 
         if (v1 != -1) {
             LinearVec3 c1 = LinearVec3(v1, v1 + 1, v1 + 2);
-            sys.addEquation(10000 * (c1 == cimg.getBlock(i).c1));
+            sys.addEquation(10000 * (c1 == cimg.getEndpoint(i, 1)));
             k++;
         }
     }
@@ -298,68 +383,368 @@ void SolverCompressedImage::fixSeams(const Mesh& m, const Image& img, Compressed
     std::cout << "Error seamless " << e1_seamless << " -> " << e2_seamless << std::endl;
     std::cout << "Error identity " << e1_id << " -> " << e2_id << std::endl;
 
-    for (int by = 0; by < resy/4; ++by)
-    for (int bx = 0; bx < resx/4; ++bx)
-    for (int ci = 0; ci < 2; ++ci) {
-        int i = vi[indexOf(bx, by, ci)];
-        if (i != -1) {
-            LinearVec3 v(i, i + 1, i + 2);
-            vec3 cval = glm::clamp(v.evaluateFor(vars), vec3(0), vec3(255));
-            cimg.setBlockColor(bx, by, ci, cval);
+    roundToLattice(vars);
+    std::cout << "Error tot after rounding " << sys.squaredErrorFor(vars) << std::endl;
+
+    std::vector<int> index;
+    std::vector<vec3> color;
+    for (const ActiveBlock& b : activeSet.block) {
+        int bx = b.index % (resx / 4);
+        int by = b.index / (resx / 4);
+        for (int ci = 0; ci < 2; ++ci) {
+            int i = vi[indexOf(bx, by, ci)];
+            if (i != -1) {
+                LinearVec3 v(i, i + 1, i + 2);
+                index.push_back(indexOf(bx, by, ci));
+                color.push_back(glm::clamp(v.evaluateFor(vars), vec3(0), vec3(255)));
+            }
         }
     }
+    cimg.setBlockColors(index.size(), index.data(), color.data());
 
     cptr = nullptr;
 }
 
+// 565 quantization of channel k of an endpoint, same as CompressedImage::quantizeBlocks()
+static const int LATTICE_MAX[3] = { 31, 63, 31 };
+
+static int latticeIndex(scalar v, int k)
+{
+    return int(std::round(glm::clamp(v, scalar(0), scalar(255)))) >> (k == 1 ? 2 : 3);
+}
+
+static scalar latticeValue(int q, int k)
+{
+    return float(q) * (255.0f / float(LATTICE_MAX[k]));
+}
+
+/* Moves the endpoint variables to 565 lattice points. Each channel of the
+ * endpoints of a block tries the lattice points next to the ones quantizeBlocks()
+ * would pick, and keeps the pair that minimizes the system error with the other
+ * blocks held fixed. The blocks are updated together (Jacobi sweeps) and the
+ * sweeps stop when the total error no longer decreases */
+void SolverCompressedImage::roundToLattice(std::vector<scalar>& vars)
+{
+    const int MAX_SWEEPS = 4;
+
+    // endpointVar() allocates the variables of an endpoint as a LinearVec3, so
+    // variable v is channel v % 3 of its endpoint
+    assert(sys.nvar % 3 == 0);
+
+    // equations that contain each variable
+    std::vector<std::vector<int>> eqOf(sys.nvar);
+    for (unsigned i = 0; i < sys.eq.size(); ++i) {
+        for (const auto& t : sys.eq[i].terms)
+            eqOf[t.first].push_back(i);
+    }
+
+    /* equations that contain channel k of either endpoint of active block j,
+     * with the coefficients of the two variables, in term[termStart[3 * j + k]]
+     * to term[termStart[3 * j + k + 1]]. They do not change between sweeps */
+    struct Term {
+        int eq;
+        scalar a0;
+        scalar a1;
+    };
+    const int nb = activeSet.block.size();
+    std::vector<int> termStart(3 * nb + 1, 0);
+    std::vector<Term> term;
+    std::vector<int> eqs;
+    for (int j = 0; j < nb; ++j) {
+        int bi = activeSet.block[j].index;
+        for (int k = 0; k < 3; ++k) {
+            int x[2] = { vi[2 * bi], vi[2 * bi + 1] };
+            eqs.clear();
+            for (int ci = 0; ci < 2; ++ci) {
+                if (x[ci] != -1) {
+                    x[ci] += k;
+                    eqs.insert(eqs.end(), eqOf[x[ci]].begin(), eqOf[x[ci]].end());
+                }
+            }
+            std::sort(eqs.begin(), eqs.end());
+            eqs.erase(std::unique(eqs.begin(), eqs.end()), eqs.end());
+
+            for (int e : eqs) {
+                Term tm = { e, 0, 0 };
+                for (const auto& t : sys.eq[e].terms) {
+                    if (t.first == x[0])
+                        tm.a0 = t.second;
+                    else if (t.first == x[1])
+                        tm.a1 = t.second;
+                }
+                term.push_back(tm);
+            }
+            termStart[3 * j + k + 1] = term.size();
+        }
+    }
+
+    std::vector<scalar> cur = vars;
+    for (int v = 0; v < sys.nvar; ++v)
+        cur[v] = latticeValue(latticeIndex(vars[v], v % 3), v % 3);
+    scalar err = sys.squaredErrorFor(cur);
+
+    const int chunk = 64;
+    int nchunks = (nb + chunk - 1) / chunk;
+    for (int sweep = 0; sweep < MAX_SWEEPS; ++sweep) {
+        std::vector<scalar> next = cur;
+        ThreadPool::instance().parallelFor(nchunks, [&](int c) {
+            std::vector<scalar> r; // residuals at cur, reused by the blocks of the chunk
+            for (int j = c * chunk; j < std::min(nb, (c + 1) * chunk); ++j) {
+                int bi = activeSet.block[j].index;
+                for (int k = 0; k < 3; ++k) {
+                    int x[2] = { vi[2 * bi], vi[2 * bi + 1] };
+                    for (int ci = 0; ci < 2; ++ci)
+                        if (x[ci] != -1)
+                            x[ci] += k;
+
+                    const Term *tm = term.data() + termStart[3 * j + k];
+                    const int nt = termStart[3 * j + k + 1] - termStart[3 * j + k];
+                    r.resize(nt);
+                    for (int e = 0; e < nt; ++e)
+                        r[e] = sys.eq[tm[e].eq].evaluateFor(cur);
+
+                    int q[2];
+                    for (int ci = 0; ci < 2; ++ci)
+                        q[ci] = (x[ci] != -1) ? latticeIndex(cur[x[ci]], k) : 0;
+
+                    scalar best = std::numeric_limits<scalar>::max();
+                    for (int d0 = -1; d0 <= 1; ++d0)
+                    for (int d1 = -1; d1 <= 1; ++d1) {
+                        int q0 = q[0] + d0;
+                        int q1 = q[1] + d1;
+                        if ((x[0] == -1 && d0 != 0) || (x[1] == -1 && d1 != 0))
+                            continue;
+                        if (q0 < 0 || q0 > LATTICE_MAX[k] || q1 < 0 || q1 > LATTICE_MAX[k])
+                            continue;
+                        scalar delta0 = (x[0] != -1) ? latticeValue(q0, k) - cur[x[0]] : 0;
+                        scalar delta1 = (x[1] != -1) ? latticeValue(q1, k) - cur[x[1]] : 0;
+                        scalar e2 = 0;
+                        for (int e = 0; e < nt; ++e) {
+                            scalar re = r[e] + tm[e].a0 * delta0 + tm[e].a1 * delta1;
+                            e2 += re * re;
+                        }
+                        if (e2 < best) {
+                            best = e2;
+                            if (x[0] != -1)
+                                next[x[0]] = latticeValue(q0, k);
+                            if (x[1] != -1)
+                                next[x[1]] = latticeValue(q1, k);
+                        }
+                    }
+                }
+            }
+        });
+
+        scalar nextErr = sys.squaredErrorFor(next);
+        if (nextErr >= err)
+            break;
+        cur.swap(next);
+        err = nextErr;
+    }
+
+    vars.swap(cur);
+}
+
 int SolverCompressedImage::indexOf(int bx, int by, int ci) const
 {
     return (by * (resx / 4) + bx) * 2 + ci;
 }
 
 LinearVec3 SolverCompressedImage::pixel(vec2 p)
+{
+    Stencil st;
+    addBilinear(p, 1, st);
+    return st.toLinearVec3();
+}
+
+// adds k times the bilinear interpolation of the texels around p to s
+void SolverCompressedImage::addBilinear(vec2 p, scalar k, Stencil& s)
 {
     p -= vec2(0.5);
     vec2 p0 = floor(p);
     vec2 p1 = floor(p + vec2(1));
     vec2 w = fract(p);
-    return mix(
-        mix(pixel(int(p0.x), int(p0.y)), pixel(int(p1.x), int(p0.y)), scalar(w.x)),
-        mix(pixel(int(p0.x), int(p1.y)), pixel(int(p1.x), int(p1.y)), scalar(w.x)),
-        scalar(w.y)
-    );
+    scalar wx = scalar(w.x);
+    scalar wy = scalar(w.y);
+
+    // same sequence of operations as mix(mix(t00, t10, wx), mix(t01, t11, wx), wy)
+    Stencil top;
+    addTexel(int(p1.x), int(p0.y), wx, top);
+    addTexel(int(p0.x), int(p0.y), 1 - wx, top);
+    top.scale(1 - wy);
+
+    Stencil bottom;
+    addTexel(int(p1.x), int(p1.y), wx, bottom);
+    addTexel(int(p0.x), int(p1.y), 1 - wx, bottom);
+
+    top.add(bottom, wy);
+    s.add(top, k);
 }
 
-LinearVec3 SolverCompressedImage::blockVars(int bx, int by, int ci)
+// adds k times the palette entry of texel (x, y) to s
+void SolverCompressedImage::addTexel(int x, int y, scalar k, Stencil& s)
 {
-    int i = indexOf(bx, by, ci);
+    // the bilinear taps are at most one texel outside the image
+    if (x < 0)
+        x += resx;
+    else if (x >= resx)
+        x -= resx;
+    if (y < 0)
+        y += resy;
+    else if (y >= resy)
+        y -= resy;
+
+    int bi = (y / 4) * (resx / 4) + (x / 4);
+    int t = (y % 4) * 4 + (x % 4);
+    int q = (indices[bi] >> (2 * t)) & 0x3;
+
+    if (QMASK_W1[q] != 0)
+        s.add(endpointVar(bi, 1), QMASK_W1[q] * k);
+    if (QMASK_W0[q] != 0)
+        s.add(endpointVar(bi, 0), QMASK_W0[q] * k);
+}
+
+int SolverCompressedImage::endpointVar(int bi, int ci)
+{
+    int i = 2 * bi + ci;
     if (vi[i] == -1) {
+        if (vi[2 * bi + 1 - ci] == -1)
+            activeSet.insertBlock(bi);
         vi[i] = sys.nvar;
-        return sys.newLinearVec3();
-    } else {
-        return LinearVec3(variable(vi[i] + 0), variable(vi[i] + 1), variable(vi[i] + 2));
+        sys.newLinearVec3();
     }
+    return vi[i];
 }
 
 LinearVec3 SolverCompressedImage::pixel(int x, int y)
 {
-    unsigned char bitmask = cptr->getMask(x, y);
-
-    x = x / 4;
-    y = y / 4;
-
-    switch (bitmask) {
-    case QMASK_C0:
-        return blockVars(x, y, 0);
-    case QMASK_C0_23_C1_13:
-        return blockVars(x, y, 0) * (2.0 / 3.0)
-             + blockVars(x, y, 1) * (1.0 / 3.0);
-    case QMASK_C0_13_C1_23:
-        return blockVars(x, y, 1) * (2.0 / 3.0)
-             + blockVars(x, y, 0) * (1.0 / 3.0);
-    case QMASK_C1:
-        return blockVars(x, y, 1);
-    default:
-        assert(0 && "Solver: invalid bit mask");
+    Stencil st;
+    addTexel(wrapCoord(x, resx), wrapCoord(y, resy), 1, st);
+    return st.toLinearVec3();
+}
+
+SolverChannelImage::SolverChannelImage()
+    : cptr{nullptr}, channel{0}
+{
+
+}
+
+void SolverChannelImage::fixSeams(const Mesh& m, const Image& img, ChannelCompressedImage& cimg)
+{
+    for (int ch = 0; ch < cimg.channels(); ++ch)
+        solveChannel(m, img, cimg, ch);
+}
+
+void SolverChannelImage::solveChannel(const Mesh& m, const Image& img, ChannelCompressedImage& cimg, int ch)
+{
+    resx = img.resx;
+    resy = img.resy;
+
+    vi.clear();
+    vi.resize(cimg.nblk() * 2, -1);
+    activeSet.clear(resx, resy);
+
+    sys.clear();
+
+    cptr = &cimg;
+    channel = ch;
+
+    // be seamless
+    for (const Seam& s : m.seam) {
+        double d = m.maxLength(s, vec2(resx, resy));
+        for (double t = 0; t <= 1; t += 1 / (2*d)) {
+            sys.addEquation(
+                pixel(m.uvpos(s.first, t) * vec2(resx, resy)) == pixel(m.uvpos(s.second, t) * vec2(resx, resy))
+            );
+        }
+    }
+    activeSet.finalize();
+    sys.printShort();
+
+    LinearEquationSet s1 = sys;
+
+    // be yourself (only the texels of blocks touched by the seam constraints)
+    activeSet.forEachTexel([&](int x, int y) {
+        double w = (img.mask(x, y) & Image::MaskBit::Internal) ? 1 : 0.1;
+        sys.addEquation(w * (pixel(x, y) == img.pixel(x, y)[ch]));
+    });
+
+    // weakly keep the endpoints where they are (same as SolverCompressedImage)
+    for (const ActiveBlock& b : activeSet.block) {
+        for (int ci = 0; ci < 2; ++ci) {
+            int v = vi[2 * b.index + ci];
+            if (v != -1)
+                sys.addEquation(0.01 * (LinearExp(v) == cimg.getEndpoint(b.index, ch, ci)));
+        }
+    }
+    sys.printShort();
+
+    std::vector<scalar> vars(sys.nvar, 10);
+
+    LinearEquationSet s2 = sys;
+    s2.eq.erase(s2.eq.begin(), s2.eq.begin() + s1.eq.size());
+    s2.solve(vars); // first solve with only identity constraints to initialize value
+
+    double e1_seamless = s1.squaredErrorFor(vars);
+    sys.solve(vars);
+    double e2_seamless = s1.squaredErrorFor(vars);
+
+    std::cout << "Error seamless (channel " << ch << ") " << e1_seamless << " -> " << e2_seamless << std::endl;
+
+    std::vector<int> index;
+    std::vector<float> value;
+    for (const ActiveBlock& b : activeSet.block) {
+        for (int ci = 0; ci < 2; ++ci) {
+            int v = vi[2 * b.index + ci];
+            if (v != -1) {
+                index.push_back((b.index * cimg.channels() + ch) * 2 + ci);
+                value.push_back(glm::clamp(float(vars[v]), 0.0f, 255.0f));
+            }
+        }
+    }
+    cimg.setBlockValues(index.size(), index.data(), value.data());
+
+    cptr = nullptr;
+}
+
+LinearExp SolverChannelImage::pixel(vec2 p)
+{
+    p -= vec2(0.5);
+    vec2 p0 = floor(p);
+    vec2 p1 = floor(p + vec2(1));
+    vec2 w = fract(p);
+    scalar wx = scalar(w.x);
+    scalar wy = scalar(w.y);
+
+    LinearExp top = pixel(int(p0.x), int(p0.y)) * (1 - wx) + pixel(int(p1.x), int(p0.y)) * wx;
+    LinearExp bottom = pixel(int(p0.x), int(p1.y)) * (1 - wx) + pixel(int(p1.x), int(p1.y)) * wx;
+    return top * (1 - wy) + bottom * wy;
+}
+
+// the palette entry of texel (x, y) in the channel being solved
+LinearExp SolverChannelImage::pixel(int x, int y)
+{
+    x = wrapCoord(x, resx);
+    y = wrapCoord(y, resy);
+
+    int bi = (y / 4) * (resx / 4) + (x / 4);
+    scalar w = ChannelCompressedImage::getWeight(cptr->getMask(x, y, channel));
+
+    LinearExp res;
+    if (w != 1)
+        res += LinearExp(endpointVar(bi, 0)) * (1 - w);
+    if (w != 0)
+        res += LinearExp(endpointVar(bi, 1)) * w;
+    return res;
+}
+
+int SolverChannelImage::endpointVar(int bi, int ci)
+{
+    int i = 2 * bi + ci;
+    if (vi[i] == -1) {
+        if (vi[2 * bi + 1 - ci] == -1)
+            activeSet.insertBlock(bi);
+        vi[i] = sys.newVar();
     }
+    return vi[i];
 }
@@ -5,6 +5,8 @@
 #include "lineareq.h"
 
 #include "compressed_image.h"
+#include "channel_image.h"
+#include "active_set.h"
 
 #include <set>
 
@@ -16,15 +18,21 @@ class Solver
 
     std::vector<int> vi; // per pixel variable index
     std::vector<int> cover; // per pixel coverage buffer
+    ActiveSet activeSet; // pixels that received a variable
 
     int resx;
     int resy;
 
+    LinearVec3 pixelAt(int i, int x, int y);
+
 public:
     Solver();
 
     void fixSeams(const Mesh& m, Image& img);
 
+    // the texels written by the last call to fixSeams()
+    const ActiveSet& modifiedTexels() const { return activeSet; }
+
     void fixSeamsMIP(const Mesh& m, Image& img, const Image& img0, const std::vector<int>& cover);
 
     //Image generateNextMipLevel(const Mesh& m, Image& imgCurr);
@@ -41,7 +49,7 @@ public:
 #endif
 
     bool active(const ivec2& p) const; // returns true if the pixel is a system variable or covered
-    int indexOf(int x, int y) const; // TODO copy to img
+    int indexOf(int x, int y) const; // same as Image::indexOf()
 
 };
 
@@ -51,22 +59,64 @@ class SolverCompressedImage {
     LinearEquationSet sys; // same as solver
     std::vector<int> vi; // same as solver
     std::vector<int> cover; // same as solver
+    ActiveSet activeSet; // blocks that received variables
     int resx; // same as solver
     int resy; // same as solver
 
     CompressedImage *cptr;
 
+    std::vector<uint32_t> indices; // 2 bit texel indices of each block, taken at the start of fixSeams()
+
+    struct Stencil;
+
+    int endpointVar(int bi, int ci);
+    void addTexel(int x, int y, scalar k, Stencil& s);
+    void addBilinear(vec2 p, scalar k, Stencil& s);
+
+    void solve(const Mesh& m, const Image& img, CompressedImage& cimg, const std::set<int>& fixedBlocks, bool keepBlockColors);
+    void roundToLattice(std::vector<scalar>& vars);
+
 public:
     SolverCompressedImage();
 
     void fixSeams(const Mesh& m, const Image& img, CompressedImage& cimg, const std::set<int>& fixedBlocks);
 
+    // same as fixSeams(), but the texels are pulled towards the colors cimg
+    // decodes to instead of an uncompressed image, masks only provides the
+    // texel masks. Only the endpoints of the blocks crossed by seams move
+    void fixSeamsEndpoints(const Mesh& m, const Image& masks, CompressedImage& cimg, const std::set<int>& fixedBlocks);
+
     int indexOf(int bx, int by, int ci) const;
     LinearVec3 pixel(int x, int y);
     LinearVec3 pixel(vec2 p); // same as Solver
-    LinearVec3 blockVars(int bx, int by, int ci);
 
 
 };
 
+/* Same formulation as SolverCompressedImage for BC4 and BC5 images: the
+ * variables are the endpoints of the blocks crossed by seams, one scalar per
+ * endpoint. The channels have their own indices, so each one is solved on its
+ * own */
+class SolverChannelImage {
+    LinearEquationSet sys;
+    std::vector<int> vi; // per endpoint variable index, for the channel being solved
+    ActiveSet activeSet; // blocks that received variables
+    int resx;
+    int resy;
+
+    ChannelCompressedImage *cptr;
+    int channel;
+
+    int endpointVar(int bi, int ci);
+    void solveChannel(const Mesh& m, const Image& img, ChannelCompressedImage& cimg, int ch);
+
+public:
+    SolverChannelImage();
+
+    void fixSeams(const Mesh& m, const Image& img, ChannelCompressedImage& cimg);
+
+    LinearExp pixel(int x, int y);
+    LinearExp pixel(vec2 p); // bilinear interpolation
+};
+
 #endif // SOLVER_H
@@ -0,0 +1,118 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+static thread_local bool insideParallelLoop = false;
+
+ThreadPool::ThreadPool()
+    : job{nullptr}, next{0}, end{0}, busy{0}, generation{0}, quit{false}
+{
+    setNumThreads(0);
+}
+
+ThreadPool::~ThreadPool()
+{
+    stop();
+}
+
+ThreadPool& ThreadPool::instance()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        quit = true;
+    }
+    wake.notify_all();
+    for (std::thread& t : workers)
+        t.join();
+    workers.clear();
+    quit = false;
+}
+
+void ThreadPool::setNumThreads(int n)
+{
+    std::lock_guard<std::mutex> callLock(callMtx);
+
+    stop();
+
+#ifdef __EMSCRIPTEN__
+    n = 1;
+#else
+    if (n <= 0)
+        n = std::max(1u, std::thread::hardware_concurrency());
+#endif
+
+    // the calling thread takes part in the loops
+    for (int i = 1; i < n; ++i)
+        workers.push_back(std::thread(&ThreadPool::workerLoop, this, generation));
+}
+
+int ThreadPool::numThreads() const
+{
+    return workers.size() + 1;
+}
+
+void ThreadPool::runJob(const std::function<void(int)> *f)
+{
+    insideParallelLoop = true;
+    int i;
+    while ((i = next++) < end)
+        (*f)(i);
+    insideParallelLoop = false;
+}
+
+void ThreadPool::workerLoop(unsigned seen)
+{
+    while (true) {
+        const std::function<void(int)> *f;
+        {
+            std::unique_lock<std::mutex> lock(mtx);
+            wake.wait(lock, [&]() { return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+            f = job;
+        }
+
+        runJob(f);
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (--busy == 0)
+            done.notify_all();
+    }
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int)>& f)
+{
+    if (n <= 0)
+        return;
+
+    if (insideParallelLoop || workers.empty() || n == 1) {
+        for (int i = 0; i < n; ++i)
+            f(i);
+        return;
+    }
+
+    std::lock_guard<std::mutex> callLock(callMtx);
+
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        job = &f;
+        next = 0;
+        end = n;
+        busy = workers.size();
+        generation++;
+    }
+    wake.notify_all();
+
+    runJob(&f);
+
+    std::unique_lock<std::mutex> lock(mtx);
+    done.wait(lock, [&]() { return busy == 0; });
+    job = nullptr;
+}
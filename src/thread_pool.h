@@ -0,0 +1,56 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Shared pool of worker threads for data parallel loops.
+ *
+ * parallelFor(n, f) calls f(i) for every i in [0, n) and returns when all the
+ * calls have completed. Indices are handed out dynamically, so f must only write
+ * to outputs owned by index i; this keeps the results independent of the number
+ * of threads. Calls issued from inside a parallel loop run serially on the
+ * calling thread. */
+class ThreadPool
+{
+    std::vector<std::thread> workers;
+
+    std::mutex mtx;
+    std::condition_variable wake;
+    std::condition_variable done;
+
+    std::mutex callMtx; // serializes parallelFor() calls from different threads
+
+    const std::function<void(int)> *job;
+    std::atomic<int> next;
+    int end;
+    int busy;
+    unsigned generation;
+    bool quit;
+
+    void workerLoop(unsigned seen);
+    void runJob(const std::function<void(int)> *f);
+    void stop();
+
+public:
+
+    ThreadPool();
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    static ThreadPool& instance();
+
+    // 0 means one thread per hardware thread
+    void setNumThreads(int n);
+    int numThreads() const;
+
+    void parallelFor(int n, const std::function<void(int)>& f);
+};
+
+#endif // THREAD_POOL_H
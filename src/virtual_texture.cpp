@@ -0,0 +1,88 @@
+#include "virtual_texture.h"
+#include "compressed_image.h"
+#include "image.h"
+#include "thread_pool.h"
+
+#include <cstring>
+#include <limits>
+#include <vector>
+
+static const uint32_t PAGE_FILE_MAGIC = ((uint32_t)('V')) | ((uint32_t)('T') << 8) | ((uint32_t)('P') << 16) | ((uint32_t)('1') << 24);
+
+bool VirtualTexture::setup(int resx, int resy, int size, int borderSize)
+{
+    if (size <= 0 || size % 4 != 0 || borderSize <= 0 || borderSize % 4 != 0 || borderSize > size)
+        return false;
+    if (resx % size != 0 || resy % size != 0)
+        return false;
+
+    pageSize = size;
+    border = borderSize;
+    pagesX = resx / size;
+    pagesY = resy / size;
+    return true;
+}
+
+void VirtualTexture::copyPage(const CompressedBlock *qb, int bw, int bh, int px, int py, CompressedBlock *out) const
+{
+    const int pbw = physicalSize() / 4;
+    for (int by = 0; by < pbw; ++by) {
+        int y = ((py * pageSize - border) / 4 + by + bh) % bh;
+        for (int bx = 0; bx < pbw; ++bx) {
+            int x = ((px * pageSize - border) / 4 + bx + bw) % bw;
+            *out++ = qb[y * bw + x];
+        }
+    }
+}
+
+bool VirtualTexture::save(const char *filename, const CompressedImage& cimg, const Image& masks, uint8_t bitmask) const
+{
+    if (cimg.resx != pagesX * pageSize || cimg.resy != pagesY * pageSize)
+        return false;
+
+    std::vector<PAGE_TOC_ENTRY> toc;
+    for (int py = 0; py < pagesY; ++py)
+    for (int px = 0; px < pagesX; ++px) {
+        bool used = (bitmask == 0);
+        for (int y = 0; y < pageSize && !used; ++y)
+        for (int x = 0; x < pageSize && !used; ++x)
+            used = (masks.mask(px * pageSize + x, py * pageSize + y) & bitmask);
+        if (used)
+            toc.push_back(PAGE_TOC_ENTRY{uint16_t(px), uint16_t(py), 0, 0});
+    }
+
+    const uint32_t pageBytes = pageBlocks() * sizeof(CompressedBlock);
+
+    size_t size = sizeof(PAGE_FILE_HEADER) + toc.size() * sizeof(PAGE_TOC_ENTRY);
+    for (PAGE_TOC_ENTRY& e : toc) {
+        e.offset = size;
+        e.size = pageBytes;
+        size += pageBytes;
+    }
+
+    // the offsets in the table of contents are 32 bit
+    if (size > std::numeric_limits<uint32_t>::max())
+        return false;
+
+    PAGE_FILE_HEADER header = {};
+    header.magic = PAGE_FILE_MAGIC;
+    header.pageSize = pageSize;
+    header.border = border;
+    header.pagesX = pagesX;
+    header.pagesY = pagesY;
+    header.numPages = toc.size();
+
+    std::vector<uint8_t> bytes(size);
+    std::memcpy(bytes.data(), &header, sizeof(PAGE_FILE_HEADER));
+    std::memcpy(bytes.data() + sizeof(PAGE_FILE_HEADER), toc.data(), toc.size() * sizeof(PAGE_TOC_ENTRY));
+
+    std::vector<CompressedBlock> qb(cimg.nblk());
+    cimg.packBlocks(qb.data());
+
+    ThreadPool::instance().parallelFor(toc.size(), [&](int i) {
+        CompressedBlock *out = reinterpret_cast<CompressedBlock *>(bytes.data() + toc[i].offset);
+        copyPage(qb.data(), cimg.resx / 4, cimg.resy / 4, toc[i].x, toc[i].y, out);
+    });
+
+    return CompressedImage::writeFile(filename, bytes);
+}
@@ -0,0 +1,62 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include "compressed_image.h"
+
+#include <cstdint>
+
+typedef struct __attribute__ ((packed)) {
+    uint32_t magic;
+    uint32_t pageSize;  // texels of each page, without the border
+    uint32_t border;    // texels added on each side of a page
+    uint32_t pagesX;
+    uint32_t pagesY;
+    uint32_t numPages;  // entries of the table of contents
+} PAGE_FILE_HEADER;
+
+typedef struct __attribute__ ((packed)) {
+    uint16_t x;
+    uint16_t y;
+    uint32_t offset;    // from the start of the file
+    uint32_t size;      // bytes of BC1 blocks, by rows of blocks
+} PAGE_TOC_ENTRY;
+
+/* Virtual texture pages. The texture is cut in pages of pageSize x pageSize
+ * texels, each stored with border texels (taken from the neighboring pages,
+ * wrapping around the texture) on every side so that bilinear lookups near
+ * the page edges do not need the other pages.
+ *
+ * pageSize and border are multiples of 4, so every block of a page, border
+ * included, is a copy of a block of the compressed texture. The pages are cut
+ * from the blocks of the whole texture after the seam-aware optimization: a
+ * lookup on a page edge then returns the same color from both pages, and the
+ * uv seams that cross page edges are optimized as in the whole texture */
+class VirtualTexture
+{
+public:
+
+    int pageSize;
+    int border;
+    int pagesX;
+    int pagesY;
+
+    VirtualTexture() : pageSize(0), border(0), pagesX(0), pagesY(0) {}
+
+    // returns false if the sizes are not supported
+    bool setup(int resx, int resy, int size, int borderSize);
+
+    int physicalSize() const { return pageSize + 2 * border; }
+    int pageBlocks() const { return (physicalSize() / 4) * (physicalSize() / 4); }
+
+    // copies the blocks of page (px, py), by rows, from the nblk() blocks of
+    // the whole texture packed in qb
+    void copyPage(const CompressedBlock *qb, int bw, int bh, int px, int py, CompressedBlock *out) const;
+
+    /* writes the pages that contain texels of the masks in bitmask (all if 0),
+     * as a PAGE_FILE_HEADER, the table of contents and the blocks of each page.
+     * The pages are packed in parallel. Returns false if the file could not be
+     * written or would not fit the 32 bit offsets of the table of contents */
+    bool save(const char *filename, const CompressedImage& cimg, const Image& masks, uint8_t bitmask) const;
+};
+
+#endif // VIRTUAL_TEXTURE_H